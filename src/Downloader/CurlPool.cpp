@@ -0,0 +1,62 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "CurlPool.h"
+#include "CurlWrapper.h"
+#include "Util.h"
+#include "Logger.h"
+
+#include <mutex>
+#include <vector>
+
+// count of idle handles kept, more are freed on release
+#define MAX_IDLE_HANDLES (MAX_PARALLEL_DOWNLOADS * 2)
+
+static std::mutex mutex;
+static std::vector<std::unique_ptr<CurlWrapper>> idle;
+static unsigned int hits = 0;
+static unsigned int misses = 0;
+
+std::unique_ptr<CurlWrapper> CurlPool::Acquire()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!idle.empty()) {
+			std::unique_ptr<CurlWrapper> curlw = std::move(idle.back());
+			idle.pop_back();
+			hits++;
+			return curlw;
+		}
+		misses++;
+	}
+	return std::unique_ptr<CurlWrapper>(new CurlWrapper());
+}
+
+void CurlPool::Release(std::unique_ptr<CurlWrapper> curlw)
+{
+	if (curlw == nullptr)
+		return;
+	curlw->Reset();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (idle.size() < MAX_IDLE_HANDLES) {
+		idle.push_back(std::move(curlw));
+	}
+}
+
+void CurlPool::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	LOG_DEBUG("curl handle pool: %u hits %u misses", hits, misses);
+	idle.clear();
+}
+
+unsigned int CurlPool::GetHits()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return hits;
+}
+
+unsigned int CurlPool::GetMisses()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return misses;
+}
@@ -0,0 +1,35 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef CURL_POOL_H
+#define CURL_POOL_H
+
+#include <memory>
+
+class CurlWrapper;
+
+/**
+ * keeps finished curl easy handles to reuse them for the next transfer,
+ * which avoids setting up a new handle (+ its connection) for each piece
+ */
+class CurlPool
+{
+public:
+	/**
+	 * returns an idle handle or creates a new one
+	 */
+	static std::unique_ptr<CurlWrapper> Acquire();
+	/**
+	 * resets the handle and keeps it for reuse, the handle must not be added
+	 * to a multi handle anymore
+	 */
+	static void Release(std::unique_ptr<CurlWrapper> curlw);
+	/**
+	 * frees all idle handles
+	 */
+	static void Clear();
+
+	static unsigned int GetHits();
+	static unsigned int GetMisses();
+};
+
+#endif
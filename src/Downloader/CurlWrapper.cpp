@@ -2,12 +2,14 @@
 
 #include <curl/curl.h>
 #include <cstring>
+#include <mutex>
 
 #include "CurlWrapper.h"
 #include "Version.h"
 #include "FileSystem/HashSHA1.h"
 #include "FileSystem/FileSystem.h"
 #include "FileSystem/File.h"
+#include "CurlPool.h"
 #include "IDownloader.h"
 #include "Logger.h"
 
@@ -26,6 +28,47 @@ constexpr const char* capath = "/etc/ssl/certs";
   (LIBCURL_VERSION_NUM >= CURL_VERSION_BITS(x, y, z))
 #endif
 
+// DNS cache and TLS sessions shared by all easy handles. Connections aren't
+// shared: the handles are used by the rapid and the http thread at once, which
+// libcurl doesn't support for the connection cache. The multi handle of the
+// http downloader and each pooled easy handle keep their own connections
+static CURLSH* share = nullptr;
+static std::mutex shareLocks[CURL_LOCK_DATA_LAST];
+
+static void LockShare(CURL* /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void* /*userptr*/)
+{
+	shareLocks[data].lock();
+}
+
+static void UnlockShare(CURL* /*handle*/, curl_lock_data data, void* /*userptr*/)
+{
+	shareLocks[data].unlock();
+}
+
+static void InitShare()
+{
+	share = curl_share_init();
+	if (share == nullptr) {
+		LOG_WARN("curl_share_init() failed, DNS and TLS sessions won't be shared");
+		return;
+	}
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, LockShare);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, UnlockShare);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static void KillShare()
+{
+	if (share == nullptr)
+		return;
+	const CURLSHcode res = curl_share_cleanup(share);
+	if (res != CURLSHE_OK) {
+		LOG_WARN("curl_share_cleanup() failed: %s", curl_share_strerror(res));
+	}
+	share = nullptr;
+}
+
 static std::string GetCAFilePath()
 {
 	return fileSystem->getSpringDir() + PATH_DELIMITER + cacertfile;
@@ -114,7 +157,9 @@ bool CurlWrapper::ValidateCaFile(const std::string& cafile)
 
 static void SetCAOptions(CURL* handle)
 {
-	if (fileSystem->directoryExists(capath)) {
+	// checked once, handles are reset and configured again for every transfer
+	static const bool hasCapath = fileSystem->directoryExists(capath);
+	if (hasCapath) {
 		LOG_DEBUG("Using capath: %s", capath);
 		const int res = curl_easy_setopt(handle, CURLOPT_CAPATH, capath);
 		if (res != CURLE_OK) {
@@ -137,8 +182,24 @@ CurlWrapper::CurlWrapper()
 {
 	handle = curl_easy_init();
 	errbuf = (char*)malloc(sizeof(char) * CURL_ERROR_SIZE);
+	list = nullptr;
+	list = curl_slist_append(list, "Cache-Control: no-cache");
+	SetDefaults();
+}
+
+void CurlWrapper::Reset()
+{
+	curl_easy_reset(handle);
+	SetDefaults();
+}
+
+void CurlWrapper::SetDefaults()
+{
 	errbuf[0] = 0;
 	curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errbuf);
+	if (share != nullptr) {
+		curl_easy_setopt(handle, CURLOPT_SHARE, share);
+	}
 
 	if (backend != CURLSSLBACKEND_SCHANNEL) {
 		SetCAOptions(handle);
@@ -155,9 +216,6 @@ CurlWrapper::CurlWrapper()
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, getVersion());
 	curl_easy_setopt(handle, CURLOPT_FAILONERROR, true);
 	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
-
-	list = nullptr;
-	list = curl_slist_append(list, "Cache-Control: no-cache");
 	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, list);
 }
 
@@ -189,6 +247,7 @@ void CurlWrapper::InitCurl()
 	DumpVersion();
 	GetTLSBackend();
 	curl_global_init(CURL_GLOBAL_ALL);
+	InitShare();
 	if (backend != CURLSSLBACKEND_SCHANNEL) {
 		ValidateCaFile(GetCAFilePath());
 	}
@@ -196,6 +255,8 @@ void CurlWrapper::InitCurl()
 
 void CurlWrapper::KillCurl()
 {
+	CurlPool::Clear();
+	KillShare();
 	curl_global_cleanup();
 }
 
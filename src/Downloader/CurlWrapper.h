@@ -13,10 +13,15 @@ public:
 		return handle;
 	}
 	std::string GetError() const;
+	/**
+	 * resets all options set for a transfer, keeps the connection cache
+	 */
+	void Reset();
 	static std::string escapeUrl(const std::string& url);
 	static void InitCurl();
 	static void KillCurl();
 private:
+	void SetDefaults();
 	static bool VerifyFile(const std::string& path);
 	static bool ValidateCaFile(const std::string& cafile);
 
@@ -6,6 +6,7 @@
 #include "FileSystem/File.h"
 #include "Mirror.h"
 
+#include <algorithm>
 #include <string>
 #include <list>
 #include <stdio.h>
@@ -48,32 +49,41 @@ Mirror* IDownload::getMirror(unsigned i) const
 	return mirrors[i];
 }
 
-Mirror* IDownload::getFastestMirror()
+Mirror* IDownload::getBestMirror(long bytes, const std::vector<const Mirror*>& skip)
 {
-	int max = -1;
+	double min = -1;
 	int pos = -1;
+	int unknown = -1; // first usable mirror without stats
+	const Mirror::time_point now = std::chrono::steady_clock::now();
 	for (unsigned i = 0; i < mirrors.size(); i++) {
-		if (mirrors[i]->status ==
-		    Mirror::STATUS_UNKNOWN) { // prefer mirrors with unknown status
+		if (!mirrors[i]->IsUsable(now) ||
+		    (std::find(skip.begin(), skip.end(), mirrors[i]) != skip.end()))
+			continue;
+		const double time = mirrors[i]->ExpectedTime(bytes);
+		if ((mirrors[i]->status == Mirror::STATUS_UNKNOWN) &&
+		    (time < 0)) { // prefer mirrors nothing is known about
 			mirrors[i]->status =
 			    Mirror::STATUS_OK; // set status to ok, to not use it again
 			LOG_DEBUG("Mirror %d: status unknown", i);
 			return mirrors[i];
 		}
-		if ((mirrors[i]->status != Mirror::STATUS_BROKEN) &&
-		    (mirrors[i]->maxspeed > max)) {
-			max = mirrors[i]->maxspeed;
+		LOG_DEBUG("Mirror %d: (%.3fs): %s", i, time, mirrors[i]->url.c_str());
+		if (time < 0) {
+			if (unknown < 0)
+				unknown = i;
+		} else if ((pos < 0) || (time < min)) {
+			min = time;
 			pos = i;
 		}
-		LOG_DEBUG("Mirror %d: (%d): %s", i, mirrors[i]->maxspeed,
-			  mirrors[i]->url.c_str());
+	}
+	if (pos < 0) {
+		pos = unknown;
 	}
 	if (pos < 0) {
 		LOG_DEBUG("no mirror selected");
 		return nullptr;
 	}
-	LOG_DEBUG("Fastest mirror %d: (%d): %s", pos, mirrors[pos]->maxspeed,
-		  mirrors[pos]->url.c_str());
+	LOG_DEBUG("Best mirror %d: (%.3fs): %s", pos, min, mirrors[pos]->url.c_str());
 	return mirrors[pos];
 }
 
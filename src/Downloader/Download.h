@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include "Rapid/Sdp.h"
 #include "DownloadEnum.h"
+#include "RateLimit.h"
 
 class DownloadData;
 class IHash;
@@ -44,7 +45,13 @@ public:
                                   */
 	std::string getUrl() const;
 	Mirror* getMirror(unsigned i) const;
-	Mirror* getFastestMirror();
+	/**
+	 * selects the mirror with the lowest expected time to transfer bytes,
+	 * mirrors without stats (from this or previous runs) are tried first,
+	 * broken / paused mirrors aren't selected
+	 * @param skip mirrors which aren't selected, i.e. the one already used
+	 */
+	Mirror* getBestMirror(long bytes, const std::vector<const Mirror*>& skip = {});
 	int getMirrorCount() const;
 	/**
   *	size of pieces, last piece size can be different
@@ -59,6 +66,7 @@ public:
 	{
 		IHash* sha;
 		PIECE_STATE state;
+		int pos = 0; // bytes received by a failed transfer, the next one continues there
 	};
 	/**
    *	sha1 sum of pieces
@@ -88,8 +96,16 @@ public:
 
 	unsigned int parallel_downloads = 0;
 	DownloadData* write_only_from = nullptr;
+	/**
+	 * pieces were made up to download a file without pieces from several
+	 * mirrors, they have no sha1, the complete file is checked with hash
+	 */
+	bool striped = false;
+	bool ranges = false; // a mirror sent a requested range, until then a single transfer is used
 
 	bool validateTLS = true;
+	// metadata (repos, sdp files) is received first when the bandwidth is limited
+	RateLimit::Priority priority = RateLimit::PRIORITY_NORMAL;
 private:
 	std::vector<Mirror*> mirrors;
 	static void initCategories();
@@ -2,8 +2,122 @@
 
 #include "DownloadData.h"
 #include "Downloader/CurlWrapper.h"
+#include "Downloader/CurlPool.h"
 
-DownloadData::DownloadData() :
-	curlw(new CurlWrapper())
+#include <algorithm>
+#include <assert.h>
+
+DownloadData::DownloadData()
+{
+}
+
+DownloadData::~DownloadData()
+{
+	CurlPool::Release(std::move(curlw));
+}
+
+void DownloadData::StartHashing()
+{
+	hashing = true;
+	pieceHash.Init();
+	hashPiece = 0;
+	hashPos = 0;
+	fileHash.Init();
+	hashedBytes = 0;
+}
+
+void DownloadList::push_back(DownloadData* data)
+{
+	assert(data->list == nullptr);
+	data->list = this;
+	data->prev = tail;
+	data->next = nullptr;
+	if (tail != nullptr) {
+		tail->next = data;
+	} else {
+		head = data;
+	}
+	tail = data;
+	count++;
+}
+
+void DownloadList::remove(DownloadData* data)
+{
+	assert(data->list == this);
+	if (data->prev != nullptr) {
+		data->prev->next = data->next;
+	} else {
+		head = data->next;
+	}
+	if (data->next != nullptr) {
+		data->next->prev = data->prev;
+	} else {
+		tail = data->prev;
+	}
+	data->prev = nullptr;
+	data->next = nullptr;
+	data->list = nullptr;
+	count--;
+}
+
+static void MoveTo(DownloadData* data, DownloadList& list)
+{
+	if (data->list == &list)
+		return;
+	if (data->list != nullptr) {
+		data->list->remove(data);
+	}
+	list.push_back(data);
+}
+
+void Transfers::Count(const DownloadData* data, int diff)
+{
+	if (data->window != nullptr) {
+		data->window->running += diff;
+	}
+	unsigned int& count = running[data->download];
+	count += diff;
+	if (count == 0) {
+		running.erase(data->download);
+	}
+}
+
+void Transfers::SetActive(DownloadData* data)
+{
+	if (data->list != &active) {
+		Count(data, 1);
+	}
+	MoveTo(data, active);
+}
+
+void Transfers::SetIdle(DownloadData* data)
+{
+	if (data->list == &active) {
+		Count(data, -1);
+	}
+	MoveTo(data, idle);
+}
+
+void Transfers::Remove(DownloadData* data)
+{
+	if (data->list == &active) {
+		Count(data, -1);
+	}
+	if (data->list != nullptr) {
+		data->list->remove(data);
+	}
+}
+
+void Transfers::WaitFor(std::chrono::steady_clock::time_point time)
+{
+	if (!waiting || (time < retry)) {
+		retry = time;
+	}
+	waiting = true;
+}
+
+long Transfers::GetWaitTime() const
 {
+	const std::chrono::steady_clock::duration left = retry - std::chrono::steady_clock::now();
+	return std::max(0L, (long)std::chrono::duration_cast<std::chrono::milliseconds>(left).count());
 }
@@ -3,24 +3,138 @@
 #ifndef _DOWNLOAD_DATA_H
 #define _DOWNLOAD_DATA_H
 
+#include <chrono>
+#include <list>
+#include <map>
 #include <memory>
+#include <string>
 #include <vector>
+#include <stddef.h>
+
+#include "TransferLimit.h"
+#include "FileSystem/HashMD5.h"
+#include "FileSystem/HashSHA1.h"
 
 class Mirror;
 class IDownload;
 class CurlWrapper;
+class DownloadList;
 
 class DownloadData
 {
 public:
 	DownloadData();
+	~DownloadData();
+	/**
+	 * resets the running hashes, has to be called before a transfer starts
+	 */
+	void StartHashing();
 
 	int start_piece = 0;
 	std::vector<unsigned int> pieces;
 	std::unique_ptr<CurlWrapper> curlw; // curl_easy_handle
 	Mirror* mirror = nullptr;     // mirror used
-	IDownload* download;
+	TransferLimit::Window* window = nullptr; // window of the mirror's host
+	IDownload* download = nullptr;
 	bool got_ranges = false; // true if headers received from server are fine
+	long written = 0; // bytes written, relative to the start of start_piece
+	int resumed = 0; // bytes of start_piece received before by a failed transfer
+	std::chrono::steady_clock::time_point received; // data was received last, stalled transfers are cancelled
+	bool retry = false; // download without pieces: the transfer failed, it's started again
+	bool paused = false; // waits for the bandwidth limit until resume
+	std::chrono::steady_clock::time_point resume;
+	std::chrono::steady_clock::time_point pausedAt;
+	std::chrono::steady_clock::duration pausedTime{0}; // the transfer was paused by us
+
+	// data is hashed while it is received, so pieces can be verified without
+	// reading them again from disk
+	bool hashing = true;	// false, when data isn't received in order
+	HashSHA1 pieceHash;	// running hash of the piece currently received
+	size_t hashPiece = 0;	// index in pieces of the piece currently received
+	int hashPos = 0;	// bytes received of the current piece
+	HashMD5 fileHash;	// running hash of the file, downloads without pieces
+	long hashedBytes = 0;	// bytes hashed in fileHash
+
+	// end-game: copy of a piece another transfer is still receiving, it's
+	// kept in memory and only written to the file when it's verified first
+	bool duplicate = false;
+	std::string buffer;
+
+	// links of the DownloadList this is in
+	DownloadData* prev = nullptr;
+	DownloadData* next = nullptr;
+	DownloadList* list = nullptr;
+};
+
+/**
+ * intrusive list of DownloadData, a DownloadData can be in one list only
+ */
+class DownloadList
+{
+public:
+	void push_back(DownloadData* data);
+	void remove(DownloadData* data);
+	DownloadData* front() const
+	{
+		return head;
+	}
+	bool empty() const
+	{
+		return head == nullptr;
+	}
+	size_t size() const
+	{
+		return count;
+	}
+
+private:
+	DownloadData* head = nullptr;
+	DownloadData* tail = nullptr;
+	size_t count = 0;
+};
+
+/**
+ * all DownloadData of a CHttpDownloader::download() call
+ */
+class Transfers
+{
+public:
+	/**
+	 * moves data to the active / idle list
+	 */
+	void SetActive(DownloadData* data);
+	void SetIdle(DownloadData* data);
+	/**
+	 * removes data from its list
+	 */
+	void Remove(DownloadData* data);
+	/**
+	 * @return count of active transfers of download
+	 */
+	unsigned int GetRunning(const IDownload* download) const
+	{
+		const auto it = running.find(download);
+		return (it != running.end()) ? it->second : 0;
+	}
+	/**
+	 * a download waits for a paused mirror / a transfer for the bandwidth
+	 * limit until time
+	 */
+	void WaitFor(std::chrono::steady_clock::time_point time);
+	/**
+	 * @return ms until the waiting downloads / transfers are started again
+	 */
+	long GetWaitTime() const;
+	DownloadList active; // curl handle is added to the multi handle
+	DownloadList idle;   // no transfer running
+	std::list<IDownload*> downloads; // downloads which may need more transfers
+	bool waiting = false; // downloads / transfers wait, see WaitFor()
+	std::chrono::steady_clock::time_point retry; // when waiting, the earliest end of a pause
+
+private:
+	// counts data as started (1) / finished (-1) transfer
+	void Count(const DownloadData* data, int diff);
+	std::map<const IDownload*, unsigned int> running;
 };
 
 #endif
@@ -0,0 +1,114 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "EpollLoop.h"
+#include "Logger.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define MAX_EVENTS 64
+#define MAX_WAIT_MS 1000 // upper limit, so aborts are noticed without traffic
+
+EpollLoop::EpollLoop(CURLM* curlm)
+    : curlm(curlm)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		LOG_ERROR("epoll_create1 failed: %s", strerror(errno));
+		return;
+	}
+	curl_multi_setopt(curlm, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+	curl_multi_setopt(curlm, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, TimerCallback);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, this);
+}
+
+EpollLoop::~EpollLoop()
+{
+	curl_multi_setopt(curlm, CURLMOPT_SOCKETFUNCTION, nullptr);
+	curl_multi_setopt(curlm, CURLMOPT_SOCKETDATA, nullptr);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, nullptr);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, nullptr);
+	if (epfd >= 0) {
+		close(epfd);
+	}
+}
+
+int EpollLoop::SocketCallback(CURL* /*easy*/, curl_socket_t s, int what, EpollLoop* loop, void* /*socketp*/)
+{
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, nullptr);
+		return 0;
+	}
+	epoll_event ev = {};
+	ev.data.fd = s;
+	if ((what & CURL_POLL_IN) != 0)
+		ev.events |= EPOLLIN;
+	if ((what & CURL_POLL_OUT) != 0)
+		ev.events |= EPOLLOUT;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev) != 0) {
+		if ((errno != ENOENT) || (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev) != 0)) {
+			LOG_ERROR("epoll_ctl failed for socket %d: %s", s, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int EpollLoop::TimerCallback(CURLM* /*multi*/, long timeout_ms, EpollLoop* loop)
+{
+	loop->timeout = timeout_ms;
+	return 0;
+}
+
+bool EpollLoop::Action(curl_socket_t s, int flags, int& running)
+{
+	const CURLMcode ret = curl_multi_socket_action(curlm, s, flags, &running);
+	if (ret != CURLM_OK) {
+		LOG_ERROR("curl_multi_socket_action error: %d", ret);
+		return false;
+	}
+	return true;
+}
+
+bool EpollLoop::Kick(int& running)
+{
+	timeout = -1;
+	return Action(CURL_SOCKET_TIMEOUT, 0, running);
+}
+
+bool EpollLoop::Poll(int& running, int maxWait)
+{
+	epoll_event events[MAX_EVENTS];
+	int wait = ((timeout < 0) || (timeout > MAX_WAIT_MS)) ? MAX_WAIT_MS : timeout;
+	if ((maxWait >= 0) && (maxWait < wait))
+		wait = maxWait;
+	const int count = epoll_wait(epfd, events, MAX_EVENTS, wait);
+	if (count < 0) {
+		if (errno == EINTR)
+			return true;
+		LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+		return false;
+	}
+	if (count == 0) {
+		return Kick(running);
+	}
+	for (int i = 0; i < count; i++) {
+		int flags = 0;
+		if ((events[i].events & EPOLLIN) != 0)
+			flags |= CURL_CSELECT_IN;
+		if ((events[i].events & EPOLLOUT) != 0)
+			flags |= CURL_CSELECT_OUT;
+		if ((events[i].events & (EPOLLERR | EPOLLHUP)) != 0)
+			flags |= CURL_CSELECT_ERR;
+		if (!Action(events[i].data.fd, flags, running))
+			return false;
+	}
+	return true;
+}
+
+#endif // __linux__
@@ -0,0 +1,47 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef EPOLL_LOOP_H
+#define EPOLL_LOOP_H
+
+#include <curl/curl.h>
+
+/**
+ * event loop driving a curl multi handle with curl_multi_socket_action:
+ * curl reports the sockets it is interested in, which are waited on with
+ * epoll, so only sockets with activity are processed
+ * (linux only, see CHttpDownloader::setOption("engine", ...))
+ */
+class EpollLoop
+{
+public:
+	explicit EpollLoop(CURLM* curlm);
+	~EpollLoop();
+	/**
+	 * @return true if the epoll instance was created
+	 */
+	bool IsValid() const
+	{
+		return epfd >= 0;
+	}
+	/**
+	 * let curl process expired timers + start newly added handles
+	 */
+	bool Kick(int& running);
+	/**
+	 * wait until a socket is ready or a timer expires and let curl process it
+	 * @param maxWait wait at most this many ms, -1 = until curl's timeout
+	 * @return false, when a fatal error occured
+	 */
+	bool Poll(int& running, int maxWait = -1);
+
+private:
+	static int SocketCallback(CURL* easy, curl_socket_t s, int what, EpollLoop* loop, void* socketp);
+	static int TimerCallback(CURLM* multi, long timeout_ms, EpollLoop* loop);
+	bool Action(curl_socket_t s, int flags, int& running);
+
+	CURLM* curlm;
+	int epfd = -1;
+	long timeout = -1; // ms until curl wants to be called, -1 = no timer set
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include "HttpDownloader.h"
 
 #include <algorithm>
+#include <limits>
 #include <stdio.h>
 #include <string>
 #include <sstream>
@@ -17,6 +18,10 @@
 #include <json/reader.h>
 
 #include "DownloadData.h"
+#include "EpollLoop.h"
+#include "Journal.h"
+#include "VerifyPool.h"
+#include "TransferLimit.h"
 #include "FileSystem/FileSystem.h"
 #include "FileSystem/File.h"
 #include "FileSystem/HashMD5.h"
@@ -24,7 +29,29 @@
 #include "Util.h"
 #include "Logger.h"
 #include "Downloader/Mirror.h"
+#include "Downloader/MirrorScore.h"
 #include "Downloader/CurlWrapper.h"
+#include "Downloader/CurlPool.h"
+#include "Downloader/RateLimit.h"
+
+#define VERIFY_POLL_MS 10 // wait for results of the worker threads
+#define ENDGAME_COPIES 16 // buffered copies of pieces which may be requested at once for a download
+#define TRANSFER_TIME 2.0 // seconds a transfer should take, the count of transfers is adapted in between
+#define STRIPE_MIN_SIZE (1024 * 1024) // smaller files without pieces are downloaded by a single transfer
+#define STRIPE_PIECE_SIZE (256 * 1024) // minimal size of made up pieces
+#define STRIPE_MAX_PIECES 1024
+#define JOURNAL_INTERVAL 1.0 // seconds between syncs of the files + journals
+#define WRITE_WAIT_MS 10 // transfers are paused while the disk is behind
+#define STALL_TIME 5.0 // seconds without data after which the pieces of a transfer are moved to other mirrors
+
+CHttpDownloader::CHttpDownloader()
+    : limit(TransferLimit::GetInstance())
+{
+}
+
+CHttpDownloader::~CHttpDownloader()
+{
+}
 
 static size_t WriteMemoryCallback(void* contents, size_t size, size_t nmemb,
 				  void* userp)
@@ -34,8 +61,9 @@ static size_t WriteMemoryCallback(void* contents, size_t size, size_t nmemb,
 	}
 
 	const size_t realsize = size * nmemb;
-	std::string* res = static_cast<std::string*>(userp);
-	res->append((char*)contents, realsize);
+	DownloadData* data = static_cast<DownloadData*>(userp);
+	rateLimit->Wait(data->mirror->host, nullptr, RateLimit::PRIORITY_HIGH, realsize);
+	data->buffer.append((char*)contents, realsize);
 	return realsize;
 }
 
@@ -47,9 +75,7 @@ static int progress_func(DownloadData* data, double total, double done, double,
 	}
 
 	data->download->progress = done;
-	if (IDownloader::listener != nullptr) {
-		IDownloader::listener(done, total);
-	}
+	IDownloader::ReportProgress(data->download, done, total);
 	if (data->got_ranges) {
 		LOG_PROGRESS(done, total, done >= total);
 	}
@@ -65,20 +91,23 @@ bool CHttpDownloader::DownloadUrl(const std::string& url, std::string& res)
 	d.download->addMirror(url);
 	d.download->name = url;
 	d.download->origin_name = url;
+	d.mirror = d.download->getMirror(0);
 
-	CurlWrapper curlw;
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_URL, CurlWrapper::escapeUrl(url).c_str());
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_WRITEDATA, (void*)&res);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_PROGRESSDATA, &d);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_XFERINFOFUNCTION, progress_func);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_NOPROGRESS, 0L);
-	const CURLcode curlres = curl_easy_perform(curlw.GetHandle());
+	d.curlw = CurlPool::Acquire();
+	CURL* curle = d.curlw->GetHandle();
+	curl_easy_setopt(curle, CURLOPT_URL, CurlWrapper::escapeUrl(url).c_str());
+	curl_easy_setopt(curle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+	curl_easy_setopt(curle, CURLOPT_WRITEDATA, (void*)&d);
+	curl_easy_setopt(curle, CURLOPT_PROGRESSDATA, &d);
+	curl_easy_setopt(curle, CURLOPT_XFERINFOFUNCTION, progress_func);
+	curl_easy_setopt(curle, CURLOPT_NOPROGRESS, 0L);
+	const CURLcode curlres = curl_easy_perform(curle);
+	res.swap(d.buffer);
 
 	delete d.download;
 	d.download = nullptr;
 	if (curlres != CURLE_OK) {
-		LOG_ERROR("Error in curl %s (%s)", curl_easy_strerror(curlres), curlw.GetError().c_str());
+		LOG_ERROR("Error in curl %s (%s)", curl_easy_strerror(curlres), d.curlw->GetError().c_str());
 	}
 	return curlres == CURLE_OK;
 }
@@ -201,29 +230,135 @@ bool CHttpDownloader::search(std::list<IDownload*>& res,
 	return ParseResult(name, dlres, res);
 }
 
+// a piece was received completely, verify it
+static void PieceReceived(DownloadData* data, unsigned int idx)
+{
+	IDownload::piece& p = data->download->pieces[idx];
+	if (!p.sha->isSet()) { // nothing to compare, checked with the file hash
+		p.state = IDownload::STATE_FINISHED;
+		return;
+	}
+	if (data->pieceHash.compare(p.sha)) {
+		p.state = IDownload::STATE_FINISHED;
+		return;
+	}
+	if ((data->resumed > 0) && (idx == (unsigned int)data->start_piece)) {
+		// the first part was sent by another transfer, it's unknown which
+		// mirror is broken
+		p.state = IDownload::STATE_NONE;
+		LOG_WARN("Continued piece %d is invalid", idx);
+		return;
+	}
+	// piece download broken, mark mirror as broken (for this file)
+	p.state = IDownload::STATE_NONE;
+	data->mirror->status = Mirror::STATUS_BROKEN;
+	LOG_WARN("Piece %d is invalid", idx);
+}
+
+// feed received data into the running hashes
+static void HashData(DownloadData* data, const char* buf, size_t len)
+{
+	if (data->download->pieces.empty()) {
+		data->fileHash.Update(buf, len);
+		data->hashedBytes += len;
+		return;
+	}
+	while ((len > 0) && (data->hashPiece < data->pieces.size())) {
+		const unsigned int idx = data->pieces[data->hashPiece];
+		const int left = data->download->file->GetPieceSize(idx) - data->hashPos;
+		const int toHash = std::min((size_t)left, len);
+		data->pieceHash.Update(buf, toHash);
+		data->hashPos += toHash;
+		buf += toHash;
+		len -= toHash;
+		if (toHash < left)
+			break;
+		data->pieceHash.Final();
+		PieceReceived(data, idx);
+		data->pieceHash.Init();
+		data->hashPiece++;
+		data->hashPos = 0;
+	}
+}
+
 static size_t multi_write_data(void* ptr, size_t size, size_t nmemb,
 			       DownloadData* data)
 {
 	if (IDownloader::AbortDownloads())
 		return -1;
 
+	// curl delivers the same data again, when the transfer is continued
+	if (CFile::IsBufferFull()) { // wait until the writer caught up
+		data->paused = true;
+		data->pausedAt = std::chrono::steady_clock::now();
+		data->resume = data->pausedAt + std::chrono::milliseconds(WRITE_WAIT_MS);
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	const double wait = rateLimit->GetWait(data->mirror->host, data->download,
+					       data->download->priority);
+	if (wait > 0) {
+		data->paused = true;
+		data->pausedAt = std::chrono::steady_clock::now();
+		data->resume = data->pausedAt +
+			       std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				   std::chrono::duration<double>(wait));
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	rateLimit->Take(data->mirror->host, data->download, size * nmemb);
+
+	if (data->duplicate) {
+		const size_t len = size * nmemb;
+		// stop, when the piece was received by the other transfer meanwhile
+		if (!data->got_ranges ||
+		    (data->download->pieces[data->start_piece].state == IDownload::STATE_FINISHED) ||
+		    (data->buffer.size() + len > (size_t)data->download->file->GetPieceSize(data->start_piece)))
+			return -1;
+		data->buffer.append((const char*)ptr, len);
+		data->pieceHash.Update((const char*)ptr, len);
+		TransferLimit::AddBytes(data->window, len);
+		return len;
+	}
+
 	// LOG_DEBUG("%d %d",size,  nmemb);
 	if (!data->got_ranges) {
+		if (data->download->ranges) {
+			// other mirrors send ranges, the file is downloaded from them
+			LOG_WARN("%s doesn't support ranges", data->mirror->url.c_str());
+			return -1;
+		}
 		LOG_INFO("Server refused ranges"); // The server refused ranges , download
 						   // only from this piece , overwrite from
 						   // 0 , and drop everything else
 
 		data->download->write_only_from = data;
+		data->download->file->SetPiecePos(0, 0);
 		data->got_ranges = true; // Silence the error
+		data->hashing = false; // pieces are verified from disk
 	}
 	if (data->download->write_only_from != nullptr &&
 	    data->download->write_only_from != data)
 		return size * nmemb;
 	else if (data->download->write_only_from != nullptr) {
-		return data->download->file->Write((const char*)ptr, size * nmemb, 0);
+		TransferLimit::AddBytes(data->window, size * nmemb);
+		if (data->download->file->Write((const char*)ptr, size * nmemb, 0) < 0)
+			return -1; // the file can't be written, the download fails
+		return size * nmemb;
 	}
-	return data->download->file->Write((const char*)ptr, size * nmemb,
+	data->received = std::chrono::steady_clock::now();
+	// the position of start_piece is reset, when it's downloaded again by
+	// another transfer after it turned out to be invalid
+	data->download->file->SetPiecePos(data->start_piece, data->written);
+	const int written = data->download->file->Write((const char*)ptr, size * nmemb,
 					   data->start_piece);
+	if (written < 0) { // the file can't be written, the download fails
+		return -1;
+	}
+	data->written += written;
+	TransferLimit::AddBytes(data->window, written);
+	if (data->hashing && (written > 0)) {
+		HashData(data, (const char*)ptr, written);
+	}
+	return written;
 }
 
 static size_t multiHeader(void* ptr, size_t size, size_t nmemb,
@@ -240,23 +375,28 @@ static size_t multiHeader(void* ptr, size_t size, size_t nmemb,
 	int count = sscanf(buf.c_str(), "Content-Range: bytes %d-%d/%d", &start, &end,
 			   &total);
 	if (count == 3) {
-		int piecesize = data->download->file->GetPiecesSize(data->pieces);
+		int piecesize = data->download->file->GetPiecesSize(data->pieces) - data->resumed;
 		if (end - start + 1 != piecesize) {
 			LOG_DEBUG("piecesize %d doesn't match server size: %d", piecesize,
 				  end - start + 1);
 			return -1;
 		}
+		if (total != data->download->file->GetPieceSize(-1)) {
+			LOG_WARN("%s has a different file size: %d", data->mirror->url.c_str(), total);
+			return -1;
+		}
 		data->got_ranges = true;
+		data->download->ranges = true;
 	}
 	LOG_DEBUG("%s", buf.c_str());
 	return size * nmemb;
 }
 
 bool CHttpDownloader::getRange(std::string& range, int start_piece,
-			       int num_pieces, int piecesize)
+			       int num_pieces, int piecesize, int offset)
 {
 	std::ostringstream s;
-	s << (int)(piecesize * start_piece) << "-"
+	s << (int)(piecesize * start_piece) + offset << "-"
 	  << (piecesize * start_piece) + piecesize * num_pieces - 1;
 	range = s.str();
 	LOG_DEBUG("%s", range.c_str());
@@ -267,36 +407,17 @@ void CHttpDownloader::showProcess(IDownload* download, bool force)
 {
 	const int done = download->getProgress();
 	const int size = download->size;
-	if (listener != nullptr) {
-		listener(done, size);
-	}
+	ReportProgress(download, done, size);
 	LOG_PROGRESS(done, size, force);
 }
 
-std::vector<unsigned int>
-CHttpDownloader::verifyAndGetNextPieces(CFile& file, IDownload* download)
+std::vector<unsigned int> CHttpDownloader::getNextPieces(IDownload* download, unsigned int count)
 {
 	std::vector<unsigned int> pieces;
 	if (download->isFinished()) {
 		return pieces;
 	}
-	// verify file by md5 if pieces.size == 0
-	if ((download->pieces.empty()) && (download->hash != nullptr) &&
-	    (download->hash->isSet())) {
-		HashMD5 md5;
-		file.Hash(md5);
-		if (md5.compare(download->hash)) {
-			LOG_INFO("md5 correct: %s", md5.toString().c_str());
-			download->state = IDownload::STATE_FINISHED;
-			showProcess(download, true);
-			return pieces;
-		} else {
-			LOG_INFO("md5 sum missmatch %s %s", download->hash->toString().c_str(),
-				 md5.toString().c_str());
-		}
-	}
 
-	HashSHA1 sha1;
 	unsigned alreadyDl = 0;
 	for (unsigned i = 0; i < download->pieces.size();
 	     i++) { // find first not downloaded piece
@@ -309,28 +430,19 @@ CHttpDownloader::verifyAndGetNextPieces(CFile& file, IDownload* download)
 				break; // Contiguos non-downloaded area finished
 			continue;
 		} else if (p.state == IDownload::STATE_NONE) {
-			if ((p.sha->isSet()) &&
-			    (!file.IsNewFile())) { // reuse piece, if checksum is fine
-				file.Hash(sha1, i);
-				//	LOG("bla %s %s", sha1.toString().c_str(),
-				// download.pieces[i].sha->toString().c_str());
-				if (sha1.compare(download->pieces[i].sha)) {
-					LOG_DEBUG("piece %d has already correct checksum, reusing", i);
-					p.state = IDownload::STATE_FINISHED;
-					showProcess(download, true);
-					alreadyDl++;
-					if (pieces.size() > 0)
-						break; // Contiguos non-downloaded area finished
-					continue;
-				}
-			}
+			if ((pieces.size() > 0) && (p.pos > 0))
+				break; // received partially, continued by the next request
 			pieces.push_back(i);
-			if (pieces.size() ==
-			    download->pieces.size() / download->parallel_downloads)
+			if (pieces.size() == count)
 				break;
+		} else if (pieces.size() > 0) {
+			break; // next piece is downloading / verified
 		}
 	}
-	if (pieces.size() == 0 && download->pieces.size() != 0) {
+	// others may be still downloading, made up pieces are finished when the
+	// file hash was checked by verifyDownloads()
+	if (pieces.size() == 0 && download->pieces.size() != 0 && !download->striped &&
+	    alreadyDl == download->pieces.size()) {
 		LOG_DEBUG("Finished\n");
 		download->state = IDownload::STATE_FINISHED;
 		showProcess(download, true);
@@ -339,12 +451,48 @@ CHttpDownloader::verifyAndGetNextPieces(CFile& file, IDownload* download)
 	return pieces;
 }
 
-bool CHttpDownloader::setupDownload(DownloadData* piece)
+// count of pieces a transfer from mirror gets, a mirror without stats only
+// gets a single piece, so an unexpectedly slow one doesn't hold up the end of
+// the download. The free pieces are shared by the allowed transfers,
+// parallel_downloads is updated by startTransfers()
+static unsigned int GetPieceCount(IDownload* download, Mirror* mirror)
 {
-	std::vector<unsigned int> pieces =
-	    verifyAndGetNextPieces(*(piece->download->file), piece->download);
+	const double time = mirror->ExpectedTime(download->piecesize);
+	if (time < 0) {
+		return 1;
+	}
+	const double latency = mirror->ExpectedTime(0);
+	const double pieces = (TRANSFER_TIME - latency) / std::max(time - latency, 0.000001);
+	unsigned int free = 0;
+	for (const IDownload::piece& p : download->pieces) {
+		if (p.state == IDownload::STATE_NONE)
+			free++;
+	}
+	const unsigned int count = free / std::max(download->parallel_downloads, 1U);
+	return std::max(1U, std::min(count, (unsigned int)std::max(pieces, 1.0)));
+}
+
+bool CHttpDownloader::setupDownload(DownloadData* piece, const std::vector<const Mirror*>& full)
+{
+	if (piece->download->isFinished())
+		return false;
+	// bytes per request, to select the mirror
+	const long bytes = piece->download->pieces.empty() ?
+	    piece->download->size : piece->download->piecesize;
+	Mirror* mirror = piece->download->getBestMirror(bytes, full);
+	if (mirror == nullptr) {
+		LOG_ERROR("No mirror found for %s", piece->download->name.c_str());
+		return false;
+	}
+	// the first transfer finds out if ranges are supported
+	const bool probe = !piece->download->ranges;
+	std::vector<unsigned int> pieces = getNextPieces(piece->download,
+	    probe ? 1 : GetPieceCount(piece->download, mirror));
 	if (piece->download->isFinished())
 		return false;
+	if (!piece->download->pieces.empty() && pieces.empty()) {
+		return false; // remaining pieces are downloaded by other transfers
+	}
 	if (piece->download->file) {
 		piece->download->size = piece->download->file->GetPieceSize(-1);
 		LOG_DEBUG("Size is %d", piece->download->size);
@@ -352,15 +500,134 @@ bool CHttpDownloader::setupDownload(DownloadData* piece)
 	piece->start_piece = pieces.size() > 0 ? pieces[0] : -1;
 	assert(piece->download->pieces.size() <= 0 || piece->start_piece >= 0);
 	piece->pieces = pieces;
-	piece->curlw = std::unique_ptr<CurlWrapper>(new CurlWrapper());
+	piece->mirror = mirror;
+	piece->duplicate = false;
+	return setupRequest(piece);
+}
 
-	CURL* curle = piece->curlw->GetHandle();
-	piece->mirror = piece->download->getFastestMirror();
-	if (piece->mirror == nullptr) {
-		LOG_ERROR("No mirror found for %s", piece->download->name.c_str());
+// active transfer of download which receives piece idx, pieces before
+// hashPiece were already received
+static DownloadData* FindTransfer(const Transfers& transfers, const IDownload* download,
+				  unsigned int idx, bool duplicate)
+{
+	for (DownloadData* data = transfers.active.front(); data != nullptr; data = data->next) {
+		if ((data->download != download) || (data->duplicate != duplicate))
+			continue;
+		if (std::find(data->pieces.begin() + data->hashPiece, data->pieces.end(), idx) !=
+		    data->pieces.end())
+			return data;
+	}
+	return nullptr;
+}
+
+bool CHttpDownloader::setupDuplicate(DownloadData* piece, const Transfers& transfers,
+				     std::vector<const Mirror*> full)
+{
+	IDownload* dl = piece->download;
+	if (dl->isFinished() || dl->pieces.empty() || (dl->write_only_from != nullptr))
+		return false;
+	unsigned int copies = 0;
+	for (DownloadData* data = transfers.active.front(); data != nullptr; data = data->next) {
+		if ((data->download == dl) && data->duplicate)
+			copies++;
+	}
+	if (copies >= ENDGAME_COPIES)
+		return false;
+
+	// copy the last piece of the transfer which is expected to finish last
+	DownloadData* owner = nullptr;
+	int idx = -1;
+	double slowest = -1;
+	for (DownloadData* data = transfers.active.front(); data != nullptr; data = data->next) {
+		if ((data->download != dl) || data->duplicate || !data->hashing)
+			continue;
+		int last = -1;
+		for (size_t i = data->hashPiece; i < data->pieces.size(); i++) {
+			const unsigned int piece = data->pieces[i];
+			if ((dl->pieces[piece].state == IDownload::STATE_DOWNLOADING) &&
+			    (FindTransfer(transfers, dl, piece, true) == nullptr))
+				last = piece;
+		}
+		if (last < 0)
+			continue;
+		const long bytes = (data->pieces.size() - data->hashPiece) * dl->piecesize - data->hashPos;
+		double time = data->mirror->ExpectedTime(bytes);
+		if (time < 0) { // nothing known, could be very slow
+			time = std::numeric_limits<double>::max();
+		}
+		if (time > slowest) {
+			slowest = time;
+			owner = data;
+			idx = last;
+		}
+	}
+	if (owner == nullptr)
 		return false;
+	full.push_back(owner->mirror);
+	Mirror* mirror = dl->getBestMirror(dl->piecesize, full);
+	if (mirror == nullptr)
+		return false;
+	const double time = mirror->ExpectedTime(dl->piecesize);
+	if ((time >= 0) && (time >= slowest)) {
+		LOG_DEBUG("%s isn't expected to be faster", mirror->url.c_str());
+		return false;
+	}
+	LOG_INFO("Piece %d: requesting a copy from %s", idx, mirror->url.c_str());
+	piece->start_piece = idx;
+	piece->pieces.assign(1, idx);
+	piece->mirror = mirror;
+	piece->duplicate = true;
+	piece->buffer.clear();
+	return setupRequest(piece);
+}
+
+// continue start_piece where a failed transfer stopped, the received part is
+// read again to hash it
+static void ResumePiece(DownloadData* data)
+{
+	IDownload* dl = data->download;
+	IDownload::piece& p = dl->pieces[data->start_piece];
+	const int pos = p.pos;
+	p.pos = 0;
+	if ((pos <= 0) || (pos >= dl->file->GetPieceSize(data->start_piece)))
+		return;
+	if (p.sha->isSet()) {
+		char buf[IO_BUF_SIZE];
+		dl->file->SetPiecePos(data->start_piece, 0);
+		for (int left = pos; left > 0;) {
+			const int len = std::min(left, (int)sizeof(buf));
+			if (dl->file->Read(buf, len, data->start_piece) != len) {
+				data->pieceHash.Init();
+				return; // downloaded again from the start
+			}
+			data->pieceHash.Update(buf, len);
+			left -= len;
+		}
+	}
+	LOG_DEBUG("Piece %d: continuing at %d", data->start_piece, pos);
+	data->resumed = pos;
+	data->written = pos;
+	data->hashPos = pos;
+}
+
+bool CHttpDownloader::setupRequest(DownloadData* piece)
+{
+	piece->got_ranges = false;
+	piece->written = 0;
+	piece->resumed = 0;
+	piece->received = std::chrono::steady_clock::now();
+	piece->paused = false;
+	piece->pausedTime = std::chrono::steady_clock::duration(0);
+	piece->retry = false;
+	piece->StartHashing();
+	if (piece->curlw == nullptr) {
+		piece->curlw = CurlPool::Acquire();
 	}
 
+	CURL* curle = piece->curlw->GetHandle();
+	piece->window = limit->GetWindow(piece->mirror->host);
+
+	curl_easy_setopt(curle, CURLOPT_PRIVATE, piece);
 	curl_easy_setopt(curle, CURLOPT_WRITEFUNCTION, multi_write_data);
 	curl_easy_setopt(curle, CURLOPT_WRITEDATA, piece);
 	curl_easy_setopt(curle, CURLOPT_NOPROGRESS, 0L);
@@ -373,22 +640,30 @@ bool CHttpDownloader::setupDownload(DownloadData* piece)
 
 	if ((piece->download->size > 0) && (piece->start_piece >= 0) &&
 	    piece->download->pieces.size() > 0) { // don't set range, if size unknown
+		if (!piece->duplicate) {
+			ResumePiece(piece);
+		}
 		std::string range;
 		if (!getRange(range, piece->start_piece, piece->pieces.size(),
-			      piece->download->piecesize)) {
+			      piece->download->piecesize, piece->resumed)) {
 			LOG_ERROR("Error getting range for download");
 			return false;
 		}
 		// set range for request, format is <start>-<end>
-		if (!(piece->start_piece == 0 &&
+		if (piece->duplicate || (piece->resumed > 0) || !(piece->start_piece == 0 &&
 		      piece->pieces.size() == piece->download->pieces.size()))
 			curl_easy_setopt(curle, CURLOPT_RANGE, range.c_str());
 		// parse server response	header as well
 		curl_easy_setopt(curle, CURLOPT_HEADERFUNCTION, multiHeader);
 		curl_easy_setopt(curle, CURLOPT_WRITEHEADER, piece);
+		if (piece->duplicate) // pieces are owned by another transfer
+			return true;
 		for (std::vector<unsigned int>::iterator it = piece->pieces.begin();
 		     it != piece->pieces.end(); ++it)
 			piece->download->pieces[*it].state = IDownload::STATE_DOWNLOADING;
+		// a previous transfer of these pieces may have failed, write from
+		// start / after the received part
+		piece->download->file->SetPiecePos(piece->start_piece, piece->resumed);
 	} else { //
 		LOG_DEBUG("single piece transfer");
 		piece->got_ranges = true;
@@ -407,39 +682,29 @@ bool CHttpDownloader::setupDownload(DownloadData* piece)
 	return true;
 }
 
-DownloadData* CHttpDownloader::getDataByHandle(const std::vector<DownloadData*>& downloads,
-				 const CURL* easy_handle) const
+void CHttpDownloader::VerifyPieces(DownloadData& data)
 {
-	// search corresponding data structure
-	for (size_t i = 0; i < downloads.size(); i++) {
-		if (downloads[i]->curlw == nullptr) { // inactive download
+	for (size_t i = 0; i < data.pieces.size(); i++) {
+		IDownload::piece& p = data.download->pieces[data.pieces[i]];
+		// verified while receiving, an invalid piece may be downloaded by
+		// another transfer already
+		if ((p.state != IDownload::STATE_DOWNLOADING) ||
+		    (data.hashing && (i < data.hashPiece))) {
+			if (p.state == IDownload::STATE_FINISHED) {
+				showProcess(data.download, true);
+			}
 			continue;
 		}
-		if (downloads[i]->curlw->GetHandle() == easy_handle) {
-			return downloads[i];
+		if (data.hashing) { // not received completely
+			p.state = IDownload::STATE_NONE;
+			if (i == data.hashPiece) { // the next transfer continues here
+				p.pos = data.hashPos;
+			}
+			continue;
 		}
-	}
-	return nullptr;
-}
-
-void CHttpDownloader::VerifyPieces(DownloadData& data, HashSHA1& sha1)
-{
-	for (size_t idx = 0; idx < data.pieces.size(); idx++) {
-		IDownload::piece& p = data.download->pieces[idx];
 		if (p.sha->isSet()) {
-			data.download->file->Hash(sha1, idx);
-
-			if (sha1.compare(p.sha)) { // piece valid
-				p.state = IDownload::STATE_FINISHED;
-				showProcess(data.download, true);
-				// LOG("piece %d verified!", idx);
-			} else { // piece download broken, mark mirror as broken (for this
-				 // file)
-				p.state = IDownload::STATE_NONE;
-				data.mirror->status = Mirror::STATUS_BROKEN;
-				// FIXME: cleanup curl handle here + process next dl
-				LOG_WARN("Piece %d is invalid", idx);
-			}
+			// stays STATE_DOWNLOADING until the result is processed
+			submitVerify(data.download, data.pieces[i], data.mirror);
 		} else {
 			LOG_INFO("sha1 checksum seems to be not set, can't check received "
 				 "piece %d-%d",
@@ -448,82 +713,344 @@ void CHttpDownloader::VerifyPieces(DownloadData& data, HashSHA1& sha1)
 	}
 }
 
+void CHttpDownloader::VerifyAllPieces(DownloadData& data, bool ok)
+{
+	IDownload* dl = data.download;
+	dl->write_only_from = nullptr;
+	for (size_t i = 0; i < dl->pieces.size(); i++) {
+		IDownload::piece& p = dl->pieces[i];
+		p.pos = 0;
+		if (!ok) {
+			p.state = IDownload::STATE_NONE;
+		} else if (p.sha->isSet()) {
+			p.state = IDownload::STATE_DOWNLOADING;
+			submitVerify(dl, i, data.mirror);
+		} else { // made up piece, checked with the file hash
+			p.state = IDownload::STATE_FINISHED;
+		}
+	}
+}
+
+bool CHttpDownloader::VerifySingleTransfer(DownloadData& data)
+{
+	IDownload* dl = data.download;
+	if ((dl->hash == nullptr) || (!dl->hash->isSet()) || (dl->file == nullptr))
+		return true;
+	if (data.hashedBytes != dl->file->GetPieceSize(-1)) {
+		return true; // not received completely, checked from disk
+	}
+	data.fileHash.Final();
+	if (data.fileHash.compare(dl->hash)) {
+		LOG_INFO("md5 correct: %s", data.fileHash.toString().c_str());
+		dl->state = IDownload::STATE_FINISHED;
+		return true;
+	}
+	LOG_ERROR("md5 sum missmatch %s %s", dl->hash->toString().c_str(),
+		  data.fileHash.toString().c_str());
+	return false;
+}
+
+// marks download as finished when all pieces are verified, made up pieces
+// are finished when the file hash was checked by verifyDownloads()
+static void CheckFinished(IDownload* download)
+{
+	if (download->striped)
+		return;
+	for (const IDownload::piece& p : download->pieces) {
+		if (p.state != IDownload::STATE_FINISHED)
+			return;
+	}
+	LOG_DEBUG("Finished");
+	download->state = IDownload::STATE_FINISHED;
+}
+
+// update the stats of the mirror with a finished transfer
+static void AddMirrorSample(DownloadData& data, CURL* curle, bool ok)
+{
+	curl_off_t bytes = 0;
+	curl_off_t total = 0; // us
+	curl_off_t ttfb = 0;  // us
+	curl_easy_getinfo(curle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	curl_easy_getinfo(curle, CURLINFO_TOTAL_TIME_T, &total);
+	curl_easy_getinfo(curle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+	// throughput after the first byte without the time we paused the
+	// transfer, latency is tracked separately
+	const curl_off_t paused =
+	    std::chrono::duration_cast<std::chrono::microseconds>(data.pausedTime).count();
+	const curl_off_t time = std::max(total - ttfb - paused, (curl_off_t)1);
+	const double speed = bytes * 1000000.0 / time;
+	LOG_DEBUG("%s: %s %.0f bytes/s ttfb %.3fs", data.mirror->host.c_str(),
+		  ok ? "ok" : "failed", speed, ttfb / 1000000.0);
+	data.mirror->AddSample(ok, speed, ttfb / 1000000.0);
+}
+
+// errors which won't go away by retrying, other errors pause the mirror
+static bool IsPermanentError(CURLcode result, long http_code)
+{
+	switch (result) {
+		case CURLE_HTTP_RETURNED_ERROR: // timeouts / rate limits are temporary
+			return (http_code >= 400) && (http_code < 500) && (http_code != 408) &&
+			       (http_code != 429);
+		case CURLE_UNSUPPORTED_PROTOCOL:
+		case CURLE_URL_MALFORMAT:
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_PEER_FAILED_VERIFICATION:
+		case CURLE_REMOTE_ACCESS_DENIED:
+		case CURLE_REMOTE_FILE_NOT_FOUND:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// transfers which were aborted by the user / failed because the received
+// data couldn't be written don't count for the mirror
+static bool IsLocalError(const DownloadData& data, CURLcode result)
+{
+	// the low speed limit is reached by transfers we paused
+	if ((result == CURLE_OPERATION_TIMEDOUT) &&
+	    (data.paused || (data.pausedTime.count() > 0)))
+		return true;
+	if ((result != CURLE_WRITE_ERROR) && (result != CURLE_ABORTED_BY_CALLBACK))
+		return false;
+	return IDownloader::AbortDownloads() ||
+	       ((data.download->file != nullptr) && data.download->file->HasError());
+}
 
-bool CHttpDownloader::processMessages(CURLM* curlm,
-				      std::vector<DownloadData*>& downloads)
+bool CHttpDownloader::processMessages(CURLM* curlm, Transfers& transfers)
 {
 	int msgs_left;
-	HashSHA1 sha1;
 	bool aborted = false;
+	bool finished = false;
 	while (struct CURLMsg* msg = curl_multi_info_read(curlm, &msgs_left)) {
 		switch (msg->msg) {
 			case CURLMSG_DONE: { // a piece has been downloaded, verify it
-				DownloadData* data = getDataByHandle(downloads, msg->easy_handle);
+				DownloadData* data = nullptr;
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&data);
+				if (data == nullptr) {
+					LOG_ERROR("Couldn't find download in download list");
+					return false;
+				}
+				finished = true;
+				if (data->duplicate) {
+					finishDuplicate(curlm, data, msg->data.result, transfers);
+					break;
+				}
+				const bool local = IsLocalError(*data, msg->data.result);
 				switch (msg->data.result) {
 					case CURLE_OK:
 						break;
 					case CURLE_HTTP_RETURNED_ERROR: // some 4* HTTP-Error (file not found,
 									// access denied,...)
 					default:
+						if (local) {
+							LOG_ERROR("Transfer of %s aborted", data->download->name.c_str());
+							break;
+						}
 						long http_code = 0;
 						curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &http_code);
 						LOG_ERROR("CURL error(%d:%d): %s %d (%s)", msg->msg, msg->data.result,
 							  curl_easy_strerror(msg->data.result), http_code,
 							  data->mirror->url.c_str());
-						if (data->start_piece >= 0) {
-							data->download->pieces[data->start_piece].state =
-							    IDownload::STATE_NONE;
+						if (IsPermanentError(msg->data.result, http_code)) {
+							data->mirror->status = Mirror::STATUS_BROKEN;
 						}
-						data->mirror->status = Mirror::STATUS_BROKEN;
-						// FIXME: cleanup curl handle here + process next dl
+						// otherwise the mirror is paused after some
+						// errors, the pieces are continued from other mirrors
 				}
-				if (data == nullptr) {
-					LOG_ERROR("Couldn't find download in download list");
-					return false;
+				const bool ok = (msg->data.result == CURLE_OK) &&
+						(data->mirror->status != Mirror::STATUS_BROKEN);
+				if (!local) {
+					AddMirrorSample(*data, msg->easy_handle, ok);
+					TransferLimit::AddResult(data->window, ok);
 				}
 				if (data->start_piece < 0) { // download without pieces
-					return false;
+					if ((msg->data.result == CURLE_OK) && !VerifySingleTransfer(*data)) {
+						data->mirror->status = Mirror::STATUS_BROKEN;
+					}
+					// the handle is kept, CleanupDownload() reads its filetime
+					curl_multi_remove_handle(curlm, data->curlw->GetHandle());
+					transfers.SetIdle(data);
+					if ((msg->data.result != CURLE_OK) ||
+					    (data->mirror->status == Mirror::STATUS_BROKEN)) {
+						data->retry = true; // from another mirror / after a pause
+						startTransfers(curlm, data->download, transfers);
+					}
+					break;
 				}
 				assert(data->download->file != nullptr);
 				assert(data->start_piece < (int)data->download->pieces.size());
 
-				VerifyPieces(*data, sha1);
+				if (data->download->write_only_from == data) {
+					VerifyAllPieces(*data, ok);
+				} else {
+					VerifyPieces(*data);
+				}
 
-				// get speed at which this piece was downloaded + update mirror info
-				double dlSpeed;
-				curl_easy_getinfo(data->curlw->GetHandle(), CURLINFO_SPEED_DOWNLOAD_T,
-						  &dlSpeed);
-				data->mirror->UpdateSpeed(dlSpeed);
 				if (data->mirror->status ==
 				    Mirror::STATUS_UNKNOWN) // set mirror status only when unset
 					data->mirror->status = Mirror::STATUS_OK;
 
 				// remove easy handle, as its finished
 				curl_multi_remove_handle(curlm, data->curlw->GetHandle());
-				data->curlw = nullptr;
+				CurlPool::Release(std::move(data->curlw));
+				transfers.SetIdle(data);
 				LOG_INFO("piece finished");
 				// piece finished / failed, try a new one
-				if (!setupDownload(data)) {
-					LOG_DEBUG(
-					    "No piece found, all pieces finished / currently downloading");
-					break;
-				}
-				const int ret = curl_multi_add_handle(curlm, data->curlw->GetHandle());
-				if (ret != CURLM_OK) {
-					LOG_ERROR("curl_multi_perform_error: %d %d", ret,
-						  CURLM_BAD_EASY_HANDLE);
-				}
+				startTransfers(curlm, data->download, transfers);
 				break;
 			}
 			default:
 				LOG_ERROR("Unhandled message %d", msg->msg);
 		}
 	}
-	return aborted;
+	// stop copies of pieces which were received by the original transfer
+	DownloadData* data = transfers.active.front();
+	while (data != nullptr) {
+		DownloadData* next = data->next;
+		if (data->duplicate &&
+		    (data->download->pieces[data->start_piece].state == IDownload::STATE_FINISHED)) {
+			finishDuplicate(curlm, data, CURLE_OK, transfers);
+		}
+		data = next;
+	}
+	if (finished) { // use the free transfers for other downloads
+		startTransfers(curlm, transfers);
+	}
+	return aborted || IDownloader::AbortDownloads();
+}
+
+// remove a running transfer, its pieces are downloaded again
+static void CancelTransfer(CURLM* curlm, DownloadData* data, Transfers& transfers)
+{
+	LOG_DEBUG("Cancelling transfer from %s", data->mirror->url.c_str());
+	curl_multi_remove_handle(curlm, data->curlw->GetHandle());
+	CurlPool::Release(std::move(data->curlw));
+	for (size_t i = data->hashPiece; i < data->pieces.size(); i++) {
+		IDownload::piece& p = data->download->pieces[data->pieces[i]];
+		if (p.state == IDownload::STATE_DOWNLOADING) {
+			p.state = IDownload::STATE_NONE;
+			p.pos = (i == data->hashPiece) ? data->hashPos : 0;
+		}
+	}
+	transfers.SetIdle(data);
+}
+
+void CHttpDownloader::finishDuplicate(CURLM* curlm, DownloadData* data, CURLcode result,
+				      Transfers& transfers)
+{
+	IDownload* dl = data->download;
+	const unsigned int idx = data->start_piece;
+	IDownload::piece& p = dl->pieces[idx];
+	bool valid = false;
+	if (p.state == IDownload::STATE_FINISHED) {
+		LOG_DEBUG("Piece %d was received by the other transfer", idx);
+	} else if (result != CURLE_OK) {
+		LOG_WARN("Copy of piece %d failed: %s (%s)", idx, curl_easy_strerror(result),
+			 data->mirror->url.c_str());
+		if (!IsLocalError(*data, result)) {
+			AddMirrorSample(*data, data->curlw->GetHandle(), false);
+			TransferLimit::AddResult(data->window, false);
+		}
+	} else {
+		data->pieceHash.Final();
+		valid = (data->buffer.size() == (size_t)dl->file->GetPieceSize(idx)) &&
+			(!p.sha->isSet() || data->pieceHash.compare(p.sha));
+		if (!valid) {
+			data->mirror->status = Mirror::STATUS_BROKEN;
+			LOG_WARN("Piece %d is invalid", idx);
+		}
+		AddMirrorSample(*data, data->curlw->GetHandle(), valid);
+		TransferLimit::AddResult(data->window, valid);
+	}
+	curl_multi_remove_handle(curlm, data->curlw->GetHandle());
+	CurlPool::Release(std::move(data->curlw));
+	transfers.SetIdle(data);
+
+	if (valid) {
+		// first verified copy wins, the other transfer is stopped before the
+		// piece is written, so it can't overwrite it
+		DownloadData* owner = FindTransfer(transfers, dl, idx, false);
+		if (owner != nullptr) {
+			CancelTransfer(curlm, owner, transfers);
+		}
+		dl->file->SetPiecePos(idx, 0);
+		if (dl->file->Write(data->buffer.data(), data->buffer.size(), idx) < 0) {
+			p.state = IDownload::STATE_NONE;
+		} else {
+			p.state = IDownload::STATE_FINISHED;
+			LOG_INFO("Piece %d received from %s", idx, data->mirror->url.c_str());
+			showProcess(dl, true);
+			CheckFinished(dl);
+		}
+		p.pos = 0;
+	}
+	std::string().swap(data->buffer);
+	data->duplicate = false;
+	// pieces of the cancelled transfer / copies of other pieces
+	startTransfers(curlm, dl, transfers);
 }
 
-static void CleanupDownloads(std::list<IDownload*>& download,
-			     std::vector<DownloadData*>& downloads)
+void CHttpDownloader::checkTransfers(CURLM* curlm, Transfers& transfers)
+{
+	if (transfers.waiting && (transfers.GetWaitTime() == 0)) {
+		transfers.waiting = false; // set again by downloads which still wait
+		startTransfers(curlm, transfers);
+	}
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	DownloadData* data = transfers.active.front();
+	while (data != nullptr) {
+		DownloadData* next = data->next;
+		if (data->paused) {
+			if (now < data->resume) {
+				transfers.WaitFor(data->resume);
+			} else {
+				data->paused = false; // set again, when the limit is still exceeded
+				data->pausedTime += now - data->pausedAt;
+				data->received = now;
+				curl_easy_pause(data->curlw->GetHandle(), CURLPAUSE_CONT);
+			}
+			data = next;
+			continue;
+		}
+		// copies are stopped when the piece is received, transfers of whole
+		// files can't be continued elsewhere
+		if (!data->duplicate && data->hashing && (data->start_piece >= 0) &&
+		    (std::chrono::duration<double>(now - data->received).count() > STALL_TIME)) {
+			LOG_WARN("No data received from %s, moving its pieces to other mirrors",
+				 data->mirror->url.c_str());
+			AddMirrorSample(*data, data->curlw->GetHandle(), false);
+			TransferLimit::AddResult(data->window, false);
+			CancelTransfer(curlm, data, transfers);
+			startTransfers(curlm, data->download, transfers);
+		}
+		data = next;
+	}
+}
+
+static void CleanupDownload(CURLM* curlm, DownloadData* data, Transfers& transfers)
+{
+	long timestamp = 0;
+	if ((data->curlw != nullptr) &&
+	    curl_easy_getinfo(data->curlw->GetHandle(), CURLINFO_FILETIME, &timestamp) == CURLE_OK) {
+		if (timestamp > 0) {
+			// decrease local timestamp if download failed to force redownload next time
+			if (!data->download->isFinished())
+				timestamp--;
+			data->download->file->SetTimestamp(timestamp);
+		}
+		delete data->download->file;
+		data->download->file = nullptr;
+	}
+	if (data->curlw != nullptr) {
+		curl_multi_remove_handle(curlm, data->curlw->GetHandle());
+	}
+	transfers.Remove(data);
+	delete data;
+}
+
+static void CleanupDownloads(CURLM* curlm, std::list<IDownload*>& download,
+			     Transfers& transfers)
 {
 	// close all open files
 	for (IDownload* dl : download) {
@@ -531,103 +1058,313 @@ static void CleanupDownloads(std::list<IDownload*>& download,
 			dl->file->Close();
 		}
 	}
-	for (size_t i = 0; i < downloads.size(); i++) {
-		long timestamp = 0;
-		if ((downloads[i]->curlw != nullptr) &&
-		    curl_easy_getinfo(downloads[i]->curlw->GetHandle(), CURLINFO_FILETIME, &timestamp) == CURLE_OK) {
-			if (timestamp > 0) {
-				// decrease local timestamp if download failed to force redownload next time
-				if (!downloads[i]->download->isFinished())
-					timestamp--;
-				downloads[i]->download->file->SetTimestamp(timestamp);
-			}
-			delete downloads[i]->download->file;
-			downloads[i]->download->file = nullptr;
-		}
-		delete downloads[i];
+	for (IDownload* dl : download) {
+		rateLimit->RemoveDownload(dl);
+	}
+	while (!transfers.active.empty()) {
+		CleanupDownload(curlm, transfers.active.front(), transfers);
+	}
+	while (!transfers.idle.empty()) {
+		CleanupDownload(curlm, transfers.idle.front(), transfers);
 	}
-
-	downloads.clear();
 }
 
-void VerifySinglePieceDownload(IDownload& dl)
+void CHttpDownloader::submitVerify(IDownload* download, int piece, Mirror* mirror)
 {
-	if ((dl.hash == nullptr) || (dl.file == nullptr))
-		return;
+	CFile* file = download->file;
+	file->Flush(); // the workers read the file with their own handle
+	VerifyPool::Job* job = new VerifyPool::Job();
+	job->download = download;
+	job->piece = piece;
+	job->mirror = mirror;
+	job->expected = (piece >= 0) ? download->pieces[piece].sha : download->hash;
+	job->path = file->GetPath();
+	job->offset = file->GetPieceStart(piece);
+	job->size = file->GetPieceSize(piece);
+	verifier->Submit(job);
+}
 
-	if (dl.file->Hash(*dl.hash)) {
-		dl.state = IDownload::STATE_FINISHED;
+bool CHttpDownloader::checkExisting(IDownload* download)
+{
+	if (download->pieces.empty() || download->striped) {
+		if ((download->hash == nullptr) || (!download->hash->isSet()))
+			return false;
+		submitVerify(download, -1, nullptr);
+		return true;
+	}
+	for (unsigned i = 0; i < download->pieces.size(); i++) {
+		IDownload::piece& p = download->pieces[i];
+		if ((p.state == IDownload::STATE_NONE) && (p.sha->isSet())) {
+			// reuse piece, if checksum is fine
+			p.state = IDownload::STATE_DOWNLOADING;
+			submitVerify(download, i, nullptr);
+		}
 	}
+	return false;
+}
 
+void CHttpDownloader::processVerified(CURLM* curlm, Transfers& transfers)
+{
+	VerifyPool::Job* job = verifier->Collect();
+	while (job != nullptr) {
+		IDownload* dl = job->download;
+		if (job->piece < 0) { // existing file without pieces
+			if (job->valid) {
+				LOG_INFO("md5 correct: %s", dl->hash->toString().c_str());
+				dl->state = IDownload::STATE_FINISHED;
+				showProcess(dl, true);
+			} else {
+				LOG_INFO("md5 sum missmatch %s", dl->name.c_str());
+				startTransfers(curlm, dl, transfers);
+			}
+		} else {
+			IDownload::piece& p = dl->pieces[job->piece];
+			if (job->valid) {
+				p.state = IDownload::STATE_FINISHED;
+				showProcess(dl, true);
+				CheckFinished(dl);
+			} else {
+				p.state = IDownload::STATE_NONE;
+				if (job->mirror != nullptr) {
+					// piece download broken, mark mirror as broken (for this file)
+					job->mirror->status = Mirror::STATUS_BROKEN;
+					LOG_WARN("Piece %d is invalid", job->piece);
+				}
+				startTransfers(curlm, dl, transfers);
+			}
+		}
+		VerifyPool::Job* next = job->next;
+		delete job;
+		job = next;
+	}
 }
 
-bool CHttpDownloader::download(std::list<IDownload*>& download,
-			       int max_parallel)
+void CHttpDownloader::verifyDownloads(std::list<IDownload*>& download)
 {
-	std::vector<DownloadData*> downloads;
-	CURLM* curlm = curl_multi_init();
+	// pieces which were still verified when the loop ended, i.e. aborted
+	verifier->Wait();
+	VerifyPool::Job* job = verifier->Collect();
+	while (job != nullptr) {
+		IDownload* dl = job->download;
+		if (job->piece >= 0) {
+			dl->pieces[job->piece].state = job->valid ? IDownload::STATE_FINISHED : IDownload::STATE_NONE;
+			CheckFinished(dl);
+		} else if (job->valid) { // existing file
+			dl->state = IDownload::STATE_FINISHED;
+		}
+		VerifyPool::Job* next = job->next;
+		delete job;
+		job = next;
+	}
+
 	for (IDownload* dl : download) {
-		if (dl->isFinished()) {
+		if ((dl->hash == nullptr) || (dl->file == nullptr) || dl->isFinished())
 			continue;
+		bool complete = true; // files of aborted downloads aren't hashed
+		for (const IDownload::piece& p : dl->pieces) {
+			complete = complete && (p.state == IDownload::STATE_FINISHED);
 		}
-		if (dl->dltype != IDownload::TYP_HTTP) {
-			LOG_DEBUG("skipping non http-dl")
+		if (complete) {
+			submitVerify(dl, -1, nullptr);
+		}
+	}
+	verifier->Wait();
+	job = verifier->Collect();
+	while (job != nullptr) {
+		IDownload* dl = job->download;
+		assert(job->piece < 0); // only whole files were submitted
+		if (job->valid) {
+			dl->state = IDownload::STATE_FINISHED;
+		} else {
+			LOG_ERROR("md5 sum missmatch %s", dl->name.c_str());
+			if (dl->striped) { // it's unknown which made up piece is broken
+				for (IDownload::piece& p : dl->pieces) {
+					p.state = IDownload::STATE_NONE;
+					p.pos = 0;
+				}
+			}
+		}
+		VerifyPool::Job* next = job->next;
+		delete job;
+		job = next;
+	}
+}
+
+void CHttpDownloader::saveJournals(const Transfers& transfers, bool force)
+{
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (!force && (std::chrono::duration<double>(now - journalSaved).count() < JOURNAL_INTERVAL))
+		return;
+	journalSaved = now;
+	// bytes received of the pieces the transfers are writing
+	std::map<IDownload*, std::map<unsigned int, int>> running;
+	for (DownloadData* data = transfers.active.front(); data != nullptr; data = data->next) {
+		if (data->duplicate || !data->hashing || (data->hashPiece >= data->pieces.size()))
 			continue;
+		running[data->download][data->pieces[data->hashPiece]] = data->hashPos;
+	}
+	for (auto& it : journals) {
+		IDownload* dl = it.first;
+		if (dl->isFinished()) {
+			it.second->Remove();
+		} else if ((dl->file != nullptr) && (dl->write_only_from == nullptr)) {
+			it.second->Save(running[dl]);
 		}
-		const int count = std::min(
-		    max_parallel,
-		    std::max(
-			1, std::min((int)dl->pieces.size(),
-				    dl->getMirrorCount()))); // count of parallel downloads
-		if (dl->getMirrorCount() <= 0) {
-			LOG_WARN("No mirrors found");
-			return false;
+	}
+}
+
+// a download without pieces is received by a single transfer, it's only
+// started again when it failed
+static bool HasSingleTransfer(const Transfers& transfers, const IDownload* download)
+{
+	if (transfers.GetRunning(download) > 0)
+		return true;
+	for (DownloadData* data = transfers.idle.front(); data != nullptr; data = data->next) {
+		if ((data->download == download) && !data->retry)
+			return true;
+	}
+	return false;
+}
+
+bool CHttpDownloader::addTransfers(CURLM* curlm, IDownload* download, Transfers& transfers)
+{
+	if (download->isFinished())
+		return false;
+	if ((download->file != nullptr) && download->file->HasError())
+		return false; // the file can't be written, no mirror helps
+	if (download->pieces.empty() && HasSingleTransfer(transfers, download))
+		return false;
+	if (!download->ranges && (transfers.GetRunning(download) > 0))
+		return false; // started when the first transfer got a range
+	// paused mirrors are only waited for, when pieces are left for them
+	bool free = download->pieces.empty();
+	for (const IDownload::piece& p : download->pieces) {
+		if (p.state == IDownload::STATE_NONE) {
+			free = true;
+			break;
 		}
-		LOG_DEBUG("Using %d parallel downloads", count);
-		dl->parallel_downloads = count;
-		if (dl->file == nullptr) {
-			dl->file = new CFile();
-			if (!dl->file->Open(dl->name, dl->size, dl->piecesize)) {
-				delete dl->file;
-				dl->file = nullptr;
-				return false;
-			}
+	}
+	DownloadData* idle = transfers.idle.front();
+	while (true) {
+		// the transfers of the other instance don't start ours when they
+		// finish, so one transfer is always allowed
+		if (!transfers.active.empty() && (limit->GetRunning() >= limit->GetLimit())) {
+			limit->SetSaturated(nullptr);
+			return true;
 		}
-		for (int i = 0; i < count; i++) {
-			DownloadData* dlData = new DownloadData();
-			dlData->download = dl;
-			// no piece found (all pieces already downloaded), skip
-			if (!setupDownload(dlData)) {
-				if (dl->state != IDownload::STATE_FINISHED) {
-					LOG_ERROR("Failed to setup download %d/%d", i, count);
-				}
-				delete dlData;
+		// mirrors whose host doesn't allow more transfers
+		std::vector<const Mirror*> full;
+		unsigned int usable = 0;
+		unsigned int slots = 0;
+		const Mirror::time_point now = std::chrono::steady_clock::now();
+		for (int i = 0; i < download->getMirrorCount(); i++) {
+			Mirror* mirror = download->getMirror(i);
+			if (mirror->status == Mirror::STATUS_BROKEN)
 				continue;
+			usable++;
+			if (!mirror->IsUsable(now)) { // paused after failures
+				if (free)
+					transfers.WaitFor(mirror->GetRetryTime());
+				full.push_back(mirror);
+				continue;
+			}
+			TransferLimit::Window* window = limit->GetWindow(mirror->host);
+			const unsigned int max = TransferLimit::GetLimit(window);
+			slots += max;
+			if (!transfers.active.empty() && (window->running >= max)) {
+				limit->SetSaturated(window);
+				full.push_back(mirror);
 			}
-			downloads.push_back(dlData);
-			curl_multi_add_handle(curlm, dlData->curlw->GetHandle());
 		}
+		if (usable == 0) {
+			LOG_ERROR("No mirror found for %s", download->name.c_str());
+			return false;
+		}
+		if (full.size() == usable) {
+			return true; // started when a transfer finished / a pause ends
+		}
+		download->parallel_downloads = std::min(slots, limit->GetLimit());
+
+		while ((idle != nullptr) && (idle->download != download)) {
+			idle = idle->next;
+		}
+		DownloadData* data = idle;
+		if (data != nullptr) {
+			idle = idle->next;
+		} else {
+			data = new DownloadData();
+			data->download = download;
+		}
+		// no piece found (all pieces already downloaded / verified)
+		if (!setupDownload(data, full) && !setupDuplicate(data, transfers, full)) {
+			if (data->list == nullptr)
+				delete data;
+			return false;
+		}
+		const int ret = curl_multi_add_handle(curlm, data->curlw->GetHandle());
+		if (ret != CURLM_OK) {
+			LOG_ERROR("curl_multi_add_handle failed: %d", ret);
+			if (data->list == nullptr)
+				delete data;
+			return false;
+		}
+		transfers.SetActive(data);
+		data->mirror->TransferStarted(now);
+		if (!download->ranges) // a single transfer until a range was received
+			return false;
 	}
-	if (downloads.empty()) {
-		LOG_DEBUG("Nothing to download!");
-		CleanupDownloads(download, downloads);
-		return true;
+}
+
+void CHttpDownloader::startTransfers(CURLM* curlm, IDownload* download, Transfers& transfers)
+{
+	if (IDownloader::AbortDownloads())
+		return; // the running transfers are stopped by the callbacks
+	std::list<IDownload*>& downloads = transfers.downloads;
+	if (std::find(downloads.begin(), downloads.end(), download) == downloads.end()) {
+		downloads.push_back(download);
+	}
+	if (!addTransfers(curlm, download, transfers)) {
+		downloads.remove(download);
+	}
+}
+
+void CHttpDownloader::startTransfers(CURLM* curlm, Transfers& transfers)
+{
+	if (IDownloader::AbortDownloads())
+		return;
+	std::list<IDownload*>::iterator it = transfers.downloads.begin();
+	while ((it != transfers.downloads.end()) &&
+	       (transfers.active.empty() || (limit->GetRunning() < limit->GetLimit()))) {
+		IDownload* download = *it;
+		++it; // download is removed from the list when it's done
+		startTransfers(curlm, download, transfers);
 	}
+}
 
+bool CHttpDownloader::selectLoop(CURLM* curlm, Transfers& transfers)
+{
 	bool aborted = false;
-	int running = 1;
-	int last = -1;
-	while (running > 0 && !aborted) {
+	int running = 0;
+	while ((!transfers.active.empty() || verifier->Pending() > 0 || transfers.waiting) &&
+	       !aborted) {
+		if (IDownloader::AbortDownloads()) {
+			aborted = true; // the running transfers are removed by the cleanup
+			break;
+		}
+		processVerified(curlm, transfers); // before perform, it may add transfers
 		CURLMcode ret = CURLM_CALL_MULTI_PERFORM;
 		while (ret == CURLM_CALL_MULTI_PERFORM) {
 			ret = curl_multi_perform(curlm, &running);
 		}
 		if (ret == CURLM_OK) {
-			//			showProcess(download, file);
-			if (last != running) { // count of running downloads changed
-				aborted = processMessages(curlm, downloads);
-				last = running++;
+			// checked every time, a transfer can finish in the same call it
+			// was started, so the count of running transfers doesn't change
+			aborted = processMessages(curlm, transfers);
+			if (limit->Update()) {
+				startTransfers(curlm, transfers);
 			}
+			checkTransfers(curlm, transfers);
+			saveJournals(transfers, false);
 		} else {
 			LOG_ERROR("curl_multi_perform_error: %d", ret);
 			aborted = true;
@@ -641,24 +1378,186 @@ bool CHttpDownloader::download(std::list<IDownload*>& download,
 		FD_ZERO(&wSet);
 		FD_ZERO(&eSet);
 		int count = 0;
+		// curl's timeout is 0 when transfers were added by processMessages
+		long timeout = -1;
+		curl_multi_timeout(curlm, &timeout);
+		if ((timeout < 0) || (timeout > 1000)) {
+			timeout = 1000;
+		}
+		if (verifier->Pending() > 0) {
+			timeout = std::min(timeout, (long)VERIFY_POLL_MS);
+		}
+		if (transfers.waiting) {
+			timeout = std::min(timeout, transfers.GetWaitTime());
+		}
 		timeval t;
-		t.tv_sec = 1;
-		t.tv_usec = 0;
+		t.tv_sec = timeout / 1000;
+		t.tv_usec = (timeout % 1000) * 1000;
 		curl_multi_fdset(curlm, &rSet, &wSet, &eSet, &count);
 		// sleep for one sec / until something happened
 		select(count + 1, &rSet, &wSet, &eSet, &t);
 	}
+	return aborted;
+}
 
-	for (IDownload* download: download) {
-		VerifySinglePieceDownload(*download);
+#ifdef __linux__
+bool CHttpDownloader::epollLoop(CURLM* curlm, Transfers& transfers)
+{
+	EpollLoop loop(curlm);
+	if (!loop.IsValid()) {
+		LOG_WARN("Falling back to select()");
+		return selectLoop(curlm, transfers);
+	}
+	int running = 0;
+	bool aborted = !loop.Kick(running);
+	while ((!transfers.active.empty() || verifier->Pending() > 0 || transfers.waiting) &&
+	       !aborted) {
+		if (IDownloader::AbortDownloads()) {
+			aborted = true; // the running transfers are removed by the cleanup
+			break;
+		}
+		int wait = verifier->Pending() > 0 ? VERIFY_POLL_MS : -1;
+		if (transfers.waiting) {
+			const int left = transfers.GetWaitTime();
+			wait = (wait < 0) ? left : std::min(wait, left);
+		}
+		// when no transfer is running, only messages of finished ones are left
+		if (((running > 0) || transfers.active.empty()) && !loop.Poll(running, wait)) {
+			aborted = true;
+			break;
+		}
+		aborted = processMessages(curlm, transfers);
+		processVerified(curlm, transfers);
+		if (limit->Update()) {
+			startTransfers(curlm, transfers);
+		}
+		checkTransfers(curlm, transfers);
+		saveJournals(transfers, false);
+		if (running <= 0) { // start handles added by processMessages
+			aborted = !loop.Kick(running) || aborted;
+		}
 	}
+	return aborted;
+}
+#endif
+
+bool CHttpDownloader::setOption(const std::string& key, const std::string& value)
+{
+	LOG_INFO("setOption %s = %s", key.c_str(), value.c_str());
+	if (key == "engine") {
+		if (value == "select") {
+			engine = ENGINE_SELECT;
+			return true;
+		}
+#ifdef __linux__
+		if (value == "epoll") {
+			engine = ENGINE_EPOLL;
+			return true;
+		}
+#endif
+		LOG_ERROR("Unsupported http engine: %s", value.c_str());
+		return false;
+	}
+	return IDownloader::setOption(key, value);
+}
+
+// splits a file without pieces into made up pieces, so ranges of it can be
+// downloaded from all mirrors. The count of pieces a transfer requests is
+// tuned to its mirror by GetPieceCount(), the complete file is checked with
+// its md5 afterwards
+static void MakePieces(IDownload* download)
+{
+	if (!download->pieces.empty() || (download->hash == nullptr) ||
+	    !download->hash->isSet() || (download->size < STRIPE_MIN_SIZE))
+		return;
+	const int piecesize = std::max(STRIPE_PIECE_SIZE,
+	    (download->size + STRIPE_MAX_PIECES - 1) / STRIPE_MAX_PIECES);
+	const int count = (download->size + piecesize - 1) / piecesize;
+	for (int i = 0; i < count; i++) {
+		IDownload::piece p;
+		p.sha = new HashSHA1();
+		p.state = IDownload::STATE_NONE;
+		download->pieces.push_back(p);
+	}
+	download->piecesize = piecesize;
+	download->striped = true;
+	LOG_DEBUG("%s: %d pieces of %d bytes", download->name.c_str(), count, piecesize);
+}
+
+bool CHttpDownloader::download(std::list<IDownload*>& download,
+			       int /*max_parallel*/)
+{
+	Transfers transfers;
+	verifier.reset(new VerifyPool());
+	journals.clear();
+	journalSaved = std::chrono::steady_clock::now();
+	CURLM* curlm = curl_multi_init();
+	for (IDownload* dl : download) {
+		if (dl->isFinished()) {
+			continue;
+		}
+		if (dl->dltype != IDownload::TYP_HTTP) {
+			LOG_DEBUG("skipping non http-dl")
+			continue;
+		}
+		if (dl->getMirrorCount() <= 0) {
+			LOG_WARN("No mirrors found");
+			return false;
+		}
+		bool resume = false;
+		if (dl->file == nullptr) {
+			MakePieces(dl);
+			if (!dl->pieces.empty()) {
+				Journal* journal = new Journal(dl);
+				journals[dl].reset(journal);
+				resume = journal->Load();
+			}
+			dl->file = new CFile();
+			if (!dl->file->Open(dl->name, dl->size, dl->piecesize, resume)) {
+				delete dl->file;
+				dl->file = nullptr;
+				return false;
+			}
+		}
+		if (!resume && !dl->file->IsNewFile() && checkExisting(dl)) {
+			continue; // started when the file turns out to be invalid
+		}
+		transfers.downloads.push_back(dl);
+	}
+	limit->Restart();
+	startTransfers(curlm, transfers);
+	if (transfers.active.empty() && (verifier->Pending() == 0)) {
+		LOG_DEBUG("Nothing to download!");
+		verifyDownloads(download);
+		saveJournals(transfers, true);
+		CleanupDownloads(curlm, download, transfers);
+		curl_multi_cleanup(curlm);
+		verifier.reset();
+		return true;
+	}
+
+	bool aborted;
+#ifdef __linux__
+	if (engine == ENGINE_EPOLL) {
+		aborted = epollLoop(curlm, transfers);
+	} else
+#endif
+	{
+		aborted = selectLoop(curlm, transfers);
+	}
+
+	verifyDownloads(download);
+	saveJournals(transfers, true);
 
 	LOG("\n");
 
 	if (!aborted) {
 		LOG_DEBUG("download complete");
 	}
-	CleanupDownloads(download, downloads);
+	CleanupDownloads(curlm, download, transfers);
 	curl_multi_cleanup(curlm);
+	verifier.reset();
+	// store the mirror stats now, other processes may start meanwhile
+	mirrorScore->Save(MirrorScore::GetPath());
 	return !aborted;
 }
@@ -6,16 +6,25 @@
 #include "Downloader/IDownloader.h"
 
 #include <curl/curl.h>
+#include <chrono>
+#include <map>
+#include <memory>
 #include <string>
 #include <list>
+#include <vector>
 
-class HashSHA1;
-class CFile;
 class DownloadData;
+class Journal;
+class Mirror;
+class Transfers;
+class TransferLimit;
+class VerifyPool;
 
 class CHttpDownloader : public IDownloader
 {
 public:
+	CHttpDownloader();
+	~CHttpDownloader();
 	/**
           downloads a file from Url to filename
   */
@@ -29,14 +38,40 @@ public:
 	const std::string& getCacheFile(const std::string& url);
 	virtual bool search(std::list<IDownload*>& result, const std::string& name,
 			    DownloadEnum::Category = DownloadEnum::CAT_NONE) override;
+	/**
+	 * max_parallel is ignored, the count of parallel transfers is adapted to
+	 * the measured goodput and errors, see TransferLimit. Large files
+	 * without pieces, but with a md5, are downloaded in ranges from all
+	 * mirrors. Mirrors are paused after failures, their pieces are continued
+	 * from other mirrors. The state of the pieces is kept in a journal next to the file,
+	 * so an interrupted download continues without hashing it again
+	 */
 	virtual bool download(std::list<IDownload*>& download,
 			      int max_parallel = 10) override;
+	/**
+	 * key "engine": "select" (default) or "epoll" (linux only), the event
+	 * loop used to drive the transfers
+	 */
+	bool setOption(const std::string& key, const std::string& value) override;
 	void showProcess(IDownload* download, bool forceOutput);
 	static bool DownloadUrl(const std::string& url, std::string& res);
 	static bool ParseResult(const std::string& name, const std::string& json,
 				std::list<IDownload*>& res);
 
 private:
+	enum Engine { ENGINE_SELECT,
+		      ENGINE_EPOLL };
+	Engine engine = ENGINE_SELECT;
+	std::unique_ptr<VerifyPool> verifier; // hashes pieces while download() runs
+	TransferLimit* limit; // shared with the other instances, see TransferLimit
+	std::map<IDownload*, std::unique_ptr<Journal>> journals; // of the downloads with pieces
+	std::chrono::steady_clock::time_point journalSaved;
+	/**
+	 * run the transfers added to curlm until all finished
+	 * @return true, when aborted
+	 */
+	bool selectLoop(CURLM* curlm, Transfers& transfers);
+	bool epollLoop(CURLM* curlm, Transfers& transfers);
 	bool parallelDownload(IDownload& download);
 	std::string escapeUrl(const std::string& url);
 	/**
@@ -45,21 +80,71 @@ private:
 
 	/**
   *	gets next piece that can be downloaded, mark it as downloading
+  *	@param full mirrors which can't take more transfers
   *	@return true when DownloadData is correctly set
   */
-	bool setupDownload(DownloadData* piece);
+	bool setupDownload(DownloadData* piece, const std::vector<const Mirror*>& full);
+	/**
+	 * end-game: when no piece is free, request a copy of a piece another
+	 * transfer is still receiving from a different mirror
+	 * @return true when DownloadData is correctly set
+	 */
+	bool setupDuplicate(DownloadData* piece, const Transfers& transfers,
+			    std::vector<const Mirror*> full);
+	/**
+	 * configures the curl handle for the pieces and mirror set in piece
+	 */
+	bool setupRequest(DownloadData* piece);
 	bool getRange(std::string& range, int start_piece, int num_pieces,
-		      int piecesize);
-	/**
-  * returns piecenum for file, which isn't already downloaded
-  * verifies if parts of a file is already downloaded (if checksums are set in
-  * download)
-  * verified parts are marked with STATE_FINISHED
-  * @return number of the piece, -1 if no peaces are avaiable and the whole file
-  * needs to be downloaded
+		      int piecesize, int offset = 0);
+	/**
+  * returns up to count of the next contiguous pieces of download, which
+  * aren't downloaded and aren't currently downloading / verified, marks
+  * download as finished when all pieces are verified
+  * @return numbers of the pieces, empty if none are available
   */
-	std::vector<unsigned int> verifyAndGetNextPieces(CFile& file,
-							 IDownload* download);
+	std::vector<unsigned int> getNextPieces(IDownload* download, unsigned int count);
+	/**
+	 * starts transfers of download until the windows of the hosts / of all
+	 * transfers are full, idle transfers are reused
+	 * @return false, when download doesn't need more transfers
+	 */
+	bool addTransfers(CURLM* curlm, IDownload* download, Transfers& transfers);
+	/**
+	 * starts transfers of download, download is kept in transfers.downloads
+	 * while it may need more transfers
+	 */
+	void startTransfers(CURLM* curlm, IDownload* download, Transfers& transfers);
+	/**
+	 * starts transfers of all downloads which may need more transfers, until
+	 * the limit is reached
+	 */
+	void startTransfers(CURLM* curlm, Transfers& transfers);
+	/**
+	 * verifies the pieces of an already existing file in the background
+	 * @return true, when the whole file is verified and transfers have to
+	 * wait for the result
+	 */
+	bool checkExisting(IDownload* download);
+	/**
+	 * queues a piece (or the whole file when piece < 0) of download for
+	 * verification by the worker threads
+	 */
+	void submitVerify(IDownload* download, int piece, Mirror* mirror);
+	/**
+	 * applies the results of the verifications done by the worker threads,
+	 * starts transfers for pieces which turned out to be invalid
+	 */
+	void processVerified(CURLM* curlm, Transfers& transfers);
+	/**
+	 * verifies downloads which couldn't be verified while they were received
+	 */
+	void verifyDownloads(std::list<IDownload*>& download);
+	/**
+	 * writes the journals of the downloads, at most once per interval unless
+	 * forced, removes the journals of finished downloads
+	 */
+	void saveJournals(const Transfers& transfers, bool force);
 	/**
   *	process curl messages
   *		- verify
@@ -69,10 +154,35 @@ private:
   *		- keep some stats (mark broken mirrors, downloadspeed)
   *	@returns false, when some fatal error occured -> abort
   */
-	bool processMessages(CURLM* curlm, std::vector<DownloadData*>& downloads);
-	DownloadData* getDataByHandle(const std::vector<DownloadData*>& downloads,
-				      const CURL* easy_handle) const;
-	void VerifyPieces(DownloadData& data, HashSHA1& sha1);
+	bool processMessages(CURLM* curlm, Transfers& transfers);
+	/**
+	 * handles a finished / cancelled copy of a piece: the first verified copy
+	 * is written, the transfer still receiving the piece is cancelled
+	 */
+	void finishDuplicate(CURLM* curlm, DownloadData* data, CURLcode result,
+			     Transfers& transfers);
+	/**
+	 * updates the state of the pieces of a finished transfer, pieces are
+	 * verified while they are received
+	 */
+	void VerifyPieces(DownloadData& data);
+	/**
+	 * the mirror of data refused ranges and sent the whole file, all pieces
+	 * are verified from disk, or downloaded again if the transfer failed
+	 */
+	void VerifyAllPieces(DownloadData& data, bool ok);
+	/**
+	 * verifies a finished download without pieces with the md5 calculated
+	 * while receiving it
+	 * @return false, when the received file is invalid
+	 */
+	bool VerifySingleTransfer(DownloadData& data);
+	/**
+	 * moves the pieces of stalled transfers to other mirrors, starts
+	 * transfers of downloads which waited for a paused mirror, continues
+	 * transfers which waited for the bandwidth limit
+	 */
+	void checkTransfers(CURLM* curlm, Transfers& transfers);
 };
 
 #endif
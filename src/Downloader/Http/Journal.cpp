@@ -0,0 +1,176 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "Journal.h"
+#include "Downloader/Download.h"
+#include "FileSystem/FileSystem.h"
+#include "FileSystem/File.h"
+#include "FileSystem/IHash.h"
+#include "Logger.h"
+
+#include <sstream>
+#include <stdio.h>
+#include <vector>
+
+#define JOURNAL_HEADER "# pr-downloader journal 1"
+
+Journal::Journal(IDownload* download)
+    : download(download)
+    , path(GetPath(download->name))
+{
+}
+
+std::string Journal::GetPath(const std::string& filename)
+{
+	return filename + ".journal";
+}
+
+// identifies the file the journal was written for
+std::string Journal::GetIdentity() const
+{
+	if ((download->hash != nullptr) && download->hash->isSet())
+		return download->hash->toString();
+	if (!download->pieces.empty() && download->pieces[0].sha->isSet())
+		return download->pieces[0].sha->toString();
+	return "-";
+}
+
+// format:
+// header
+// <size> <piecesize> <count of pieces> <identity>
+// bitmap of finished pieces, hex, 4 pieces per digit
+// <piece> <bytes received>, for each unfinished piece with received bytes
+std::string Journal::Format(const std::map<unsigned int, int>& running) const
+{
+	static const char* digits = "0123456789abcdef";
+	std::ostringstream out;
+	out << JOURNAL_HEADER << "\n";
+	out << download->size << " " << download->piecesize << " " << download->pieces.size()
+	    << " " << GetIdentity() << "\n";
+	std::string bitmap((download->pieces.size() + 3) / 4, '0');
+	for (size_t i = 0; i < download->pieces.size(); i++) {
+		if (download->pieces[i].state == IDownload::STATE_FINISHED) {
+			bitmap[i / 4] |= 8 >> (i % 4);
+		}
+	}
+	for (char& c : bitmap) {
+		c = digits[c - '0'];
+	}
+	out << bitmap << "\n";
+	for (size_t i = 0; i < download->pieces.size(); i++) {
+		const IDownload::piece& p = download->pieces[i];
+		int pos = 0;
+		if (p.state == IDownload::STATE_NONE) {
+			pos = p.pos;
+		} else if (p.state == IDownload::STATE_DOWNLOADING) {
+			const std::map<unsigned int, int>::const_iterator it = running.find(i);
+			if (it != running.end())
+				pos = it->second;
+		}
+		if (pos > 0) {
+			out << i << " " << pos << "\n";
+		}
+	}
+	return out.str();
+}
+
+bool Journal::Load()
+{
+	if (!fileSystem->fileExists(path)) {
+		return false;
+	}
+	exists = true;
+	FILE* f = fileSystem->propen(path, "r");
+	if (f == nullptr) {
+		return false;
+	}
+	std::string content;
+	char buf[IO_BUF_SIZE];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		content.append(buf, len);
+	}
+	fclose(f);
+
+	std::istringstream in(content);
+	std::string header;
+	std::string bitmap;
+	long size = -1;
+	int piecesize = 0;
+	size_t count = 0;
+	std::string identity;
+	std::getline(in, header);
+	in >> size >> piecesize >> count >> identity >> bitmap;
+	if (in.fail() || (header != JOURNAL_HEADER)) {
+		LOG_WARN("Invalid journal %s", path.c_str());
+		return false;
+	}
+	if ((size != download->size) || (piecesize != download->piecesize) ||
+	    (count != download->pieces.size()) || (count == 0) ||
+	    (identity != GetIdentity()) || (bitmap.size() != (count + 3) / 4) ||
+	    (bitmap.find_first_not_of("0123456789abcdef") != std::string::npos)) {
+		LOG_INFO("Journal %s was written for another file", path.c_str());
+		return false;
+	}
+	if (!fileSystem->fileExists(download->name) &&
+	    !fileSystem->fileExists(CFile::GetTmpPath(download->name))) {
+		return false;
+	}
+
+	std::vector<int> pos(count, 0);
+	unsigned int piece;
+	int received;
+	while (in >> piece >> received) {
+		if ((piece >= count) || (received <= 0) || (received >= piecesize)) {
+			LOG_WARN("Invalid journal %s", path.c_str());
+			return false;
+		}
+		pos[piece] = received;
+	}
+	unsigned int finished = 0;
+	for (size_t i = 0; i < count; i++) {
+		const char c = bitmap[i / 4];
+		const int digit = (c >= 'a') ? c - 'a' + 10 : c - '0';
+		IDownload::piece& p = download->pieces[i];
+		if (digit & (8 >> (i % 4))) {
+			p.state = IDownload::STATE_FINISHED;
+			p.pos = 0;
+			finished++;
+		} else {
+			p.state = IDownload::STATE_NONE;
+			p.pos = pos[i];
+		}
+	}
+	saved = content;
+	LOG_INFO("Continuing %s, %u of %u pieces finished", download->name.c_str(), finished,
+		 (unsigned int)count);
+	return true;
+}
+
+bool Journal::Save(const std::map<unsigned int, int>& running)
+{
+	const std::string content = Format(running);
+	if (content == saved) {
+		return true;
+	}
+	// the journal must not claim data which isn't on disk yet
+	if ((download->file != nullptr) && !download->file->Sync()) {
+		LOG_ERROR("Error syncing %s", download->name.c_str());
+		return false;
+	}
+	if (!fileSystem->WriteFileAtomic(path, content, true)) {
+		return false;
+	}
+	saved = content;
+	exists = true;
+	return true;
+}
+
+void Journal::Remove()
+{
+	if (!exists) {
+		return;
+	}
+	fileSystem->removeFile(path);
+	saved.clear();
+	exists = false;
+}
@@ -0,0 +1,53 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <map>
+#include <string>
+
+class IDownload;
+
+/**
+ * keeps the state of the pieces of a http download in a small file next to
+ * it: a bitmap of the finished pieces and the count of bytes received of
+ * unfinished ones. A download continued after a crash / abort restores the
+ * pieces from it instead of hashing the whole file again. The journal is only
+ * written after the received data was synced to disk, so it never claims
+ * more than the file contains
+ */
+class Journal
+{
+public:
+	explicit Journal(IDownload* download);
+	/**
+	 * restores the state of the pieces, if the journal was written for the
+	 * same file and the file is still there
+	 * @return true, if the pieces were restored
+	 */
+	bool Load();
+	/**
+	 * syncs the file and writes the journal, if the state of the pieces
+	 * changed since the last call
+	 * @param running bytes received of pieces, which are still downloading
+	 */
+	bool Save(const std::map<unsigned int, int>& running);
+	/**
+	 * removes the journal, i.e. when the download is finished
+	 */
+	void Remove();
+	/**
+	 * @return path of the journal of the file filename
+	 */
+	static std::string GetPath(const std::string& filename);
+
+private:
+	std::string Format(const std::map<unsigned int, int>& running) const;
+	std::string GetIdentity() const;
+	IDownload* download;
+	std::string path;
+	std::string saved; // contents written / loaded last
+	bool exists = false;
+};
+
+#endif
@@ -0,0 +1,168 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "TransferLimit.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <tuple>
+
+#define INITIAL_TRANSFERS 8	// all hosts
+#define MAX_TRANSFERS 64
+#define INITIAL_HOST_TRANSFERS 2
+#define MAX_HOST_TRANSFERS 16
+#define CONTROL_INTERVAL 0.5	// seconds between adapting the windows
+#define STARTUP_GAIN 1.25	// goodput growth needed to keep doubling a window
+#define PROBE_GAIN 1.05		// goodput growth needed to add a transfer
+#define COLLAPSE 0.7		// goodput drop which shrinks a window
+#define ERROR_DECREASE 0.5
+#define COLLAPSE_DECREASE 0.75
+
+static TransferLimit* singleton = nullptr;
+
+TransferLimit::TransferLimit()
+{
+	total.size = INITIAL_TRANSFERS;
+	start = std::chrono::steady_clock::now();
+}
+
+TransferLimit* TransferLimit::GetInstance()
+{
+	if (singleton == nullptr) {
+		singleton = new TransferLimit();
+	}
+	return singleton;
+}
+
+void TransferLimit::Shutdown()
+{
+	delete singleton;
+	singleton = nullptr;
+}
+
+TransferLimit::Window* TransferLimit::GetWindow(const std::string& host)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<std::string, Window>::iterator it = hosts.find(host);
+	if (it == hosts.end()) {
+		it = hosts.emplace(std::piecewise_construct, std::forward_as_tuple(host),
+				   std::forward_as_tuple())
+			 .first;
+		it->second.size = INITIAL_HOST_TRANSFERS;
+	}
+	return &it->second;
+}
+
+unsigned int TransferLimit::GetLimit(const Window* window)
+{
+	return std::max(1U, (unsigned int)window->size);
+}
+
+unsigned int TransferLimit::GetRunning() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	unsigned int running = 0;
+	for (const auto& it : hosts) {
+		running += it.second.running;
+	}
+	return running;
+}
+
+void TransferLimit::SetSaturated(Window* window)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (window == nullptr) {
+		window = &total;
+	}
+	window->saturated = true;
+}
+
+void TransferLimit::AddResult(Window* window, bool ok)
+{
+	if (!ok) {
+		window->errors++;
+	}
+}
+
+void TransferLimit::Restart()
+{
+	if (GetRunning() > 0) { // keep the measurement of the other thread
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	start = std::chrono::steady_clock::now();
+	total.bytes = 0;
+	total.goodput = 0;
+	total.saturated = false;
+	for (auto& it : hosts) {
+		Window& window = it.second;
+		window.bytes = 0;
+		window.errors = 0;
+		window.goodput = 0;
+		window.saturated = false;
+	}
+}
+
+bool TransferLimit::Update()
+{
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double elapsed;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		elapsed = std::chrono::duration<double>(now - start).count();
+		if (elapsed < CONTROL_INTERVAL) {
+			return false;
+		}
+		start = now;
+	}
+	return Update(elapsed);
+}
+
+bool TransferLimit::Update(double elapsed)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	bool grown = false;
+	total.bytes = 0;
+	for (auto& it : hosts) {
+		total.bytes += it.second.bytes;
+		if (Adapt(it.second, elapsed, 1, MAX_HOST_TRANSFERS)) {
+			grown = true;
+		}
+		LOG_DEBUG("%s: %.1f transfers, %.0f bytes/s", it.first.c_str(),
+			  it.second.size.load(), it.second.goodput);
+	}
+	if (Adapt(total, elapsed, 1, MAX_TRANSFERS)) {
+		grown = true;
+	}
+	LOG_DEBUG("total: %.1f transfers, %.0f bytes/s", total.size.load(), total.goodput);
+	return grown;
+}
+
+bool TransferLimit::Adapt(Window& window, double elapsed, double min, double max)
+{
+	const double goodput = window.bytes.exchange(0) / elapsed;
+	const double size = window.size;
+	double next = size;
+	if (window.errors.exchange(0) > 0) { // the host is overloaded or broken
+		next *= ERROR_DECREASE;
+		window.startup = false;
+	} else if (window.saturated) { // more transfers may help
+		const bool first = window.goodput <= 0;
+		if (window.startup) {
+			if (first || (goodput >= window.goodput * STARTUP_GAIN)) {
+				next *= 2;
+			} else { // the link is full, give up what the last doubling added
+				next *= COLLAPSE_DECREASE;
+				window.startup = false;
+			}
+		} else if (first || (goodput >= window.goodput * PROBE_GAIN)) {
+			next += 1;
+		} else if (goodput < window.goodput * COLLAPSE) {
+			next *= COLLAPSE_DECREASE;
+		}
+	}
+	next = std::min(std::max(next, min), max);
+	window.size = next;
+	window.goodput = goodput;
+	window.saturated = false;
+	return next > size;
+}
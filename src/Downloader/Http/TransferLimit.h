@@ -0,0 +1,101 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef TRANSFER_LIMIT_H
+#define TRANSFER_LIMIT_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <string>
+
+/**
+ * adapts the count of parallel transfers to what the link and the mirrors
+ * can handle: there is a window of allowed transfers for each host and one
+ * for all transfers. Once per interval a window which limited the transfers
+ * grows as long as the goodput received through it grows (doubling at first,
+ * then additive) and shrinks multiplicatively when the goodput collapses or,
+ * for hosts, when transfers failed.
+ * One instance is shared by the http and the rapid thread, so both stay
+ * within the same windows.
+ */
+class TransferLimit
+{
+public:
+	// the counters are changed by the transfers without locking, the rest
+	// is guarded by the mutex of the TransferLimit
+	struct Window {
+		std::atomic<double> size{0};	// allowed transfers
+		double goodput = 0;	// bytes/s received in the last interval
+		std::atomic<size_t> bytes{0};	// bytes received in the current interval
+		std::atomic<unsigned int> errors{0}; // failed transfers in the current interval
+		std::atomic<unsigned int> running{0}; // active transfers, counted by Transfers
+		bool saturated = false;	// the window held back transfers
+		bool startup = true;	// doubled until the goodput stops growing
+	};
+
+	TransferLimit();
+
+	static TransferLimit* GetInstance();
+	static void Shutdown();
+
+	/**
+	 * @return the window of host, created when it's not known yet. The
+	 * pointer stays valid
+	 */
+	Window* GetWindow(const std::string& host);
+	/**
+	 * @return count of transfers allowed for the window / for all hosts
+	 */
+	static unsigned int GetLimit(const Window* window);
+	unsigned int GetLimit() const
+	{
+		return GetLimit(&total);
+	}
+	/**
+	 * @return count of active transfers of all hosts
+	 */
+	unsigned int GetRunning() const;
+	/**
+	 * a window held back a transfer, nullptr = the window of all transfers
+	 */
+	void SetSaturated(Window* window);
+	/**
+	 * add received data
+	 */
+	static void AddBytes(Window* window, size_t bytes)
+	{
+		window->bytes += bytes;
+	}
+	/**
+	 * add the result of a finished transfer
+	 */
+	static void AddResult(Window* window, bool ok);
+
+	/**
+	 * starts a new measurement, i.e. when transfers are started after a
+	 * pause. Ignored while transfers are running
+	 */
+	void Restart();
+	/**
+	 * adapts the windows when an interval is over
+	 * @return true when a window was enlarged
+	 */
+	bool Update();
+	/**
+	 * adapts the windows to the data received in the last elapsed seconds
+	 */
+	bool Update(double elapsed);
+
+private:
+	static bool Adapt(Window& window, double elapsed, double min, double max);
+	Window total;
+	std::map<std::string, Window> hosts;
+	std::chrono::steady_clock::time_point start;
+	mutable std::mutex mutex;
+};
+
+#define transferLimit TransferLimit::GetInstance()
+
+#endif
@@ -0,0 +1,106 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "VerifyPool.h"
+#include "FileSystem/File.h"
+#include "FileSystem/HashMD5.h"
+#include "FileSystem/HashSHA1.h"
+
+#include <algorithm>
+
+#define MAX_VERIFY_THREADS 4
+
+VerifyPool::VerifyPool(unsigned int threads)
+{
+	if (threads == 0) {
+		threads = std::min(std::thread::hardware_concurrency(), (unsigned)MAX_VERIFY_THREADS);
+	}
+	threads = std::max(threads, 1U);
+	for (unsigned int i = 0; i < threads; i++) {
+		workers.emplace_back(&VerifyPool::Work, this);
+	}
+}
+
+VerifyPool::~VerifyPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	queued.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	for (Job* job : jobs) {
+		delete job;
+	}
+	Job* job = Collect();
+	while (job != nullptr) {
+		Job* next = job->next;
+		delete job;
+		job = next;
+	}
+}
+
+void VerifyPool::Submit(Job* job)
+{
+	pending++;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(job);
+		running++;
+	}
+	queued.notify_one();
+}
+
+VerifyPool::Job* VerifyPool::Collect()
+{
+	Job* job = done.exchange(nullptr, std::memory_order_acquire);
+	// reverse, the workers push to the front
+	Job* res = nullptr;
+	while (job != nullptr) {
+		Job* next = job->next;
+		job->next = res;
+		res = job;
+		job = next;
+		pending--;
+	}
+	return res;
+}
+
+void VerifyPool::Wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	finished.wait(lock, [this] { return running == 0; });
+}
+
+void VerifyPool::Work()
+{
+	while (true) {
+		Job* job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			queued.wait(lock, [this] { return stop || !jobs.empty(); });
+			if (stop)
+				return;
+			job = jobs.front();
+			jobs.pop_front();
+		}
+
+		HashSHA1 sha1;
+		HashMD5 md5;
+		IHash& hash = (job->piece >= 0) ? (IHash&)sha1 : (IHash&)md5;
+		job->valid = CFile::Hash(job->path, job->offset, job->size, hash) &&
+			     hash.compare(job->expected);
+
+		job->next = done.load(std::memory_order_relaxed);
+		while (!done.compare_exchange_weak(job->next, job, std::memory_order_release,
+						   std::memory_order_relaxed)) {
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running--;
+		}
+		finished.notify_all();
+	}
+}
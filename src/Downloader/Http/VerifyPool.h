@@ -0,0 +1,82 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef VERIFY_POOL_H
+#define VERIFY_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class IDownload;
+class IHash;
+class Mirror;
+
+/**
+ * hashes pieces / files on worker threads, so the curl loop can keep
+ * receiving data meanwhile. Finished jobs are handed back through a lock-free
+ * queue which is emptied by the loop with Collect()
+ */
+class VerifyPool
+{
+public:
+	struct Job {
+		IDownload* download = nullptr;
+		int piece = -1;		     // piece to verify (sha1), -1 = complete file (md5)
+		Mirror* mirror = nullptr;    // mirror the data came from, nullptr = local file
+		const IHash* expected = nullptr; // hash to compare with, has to stay valid
+		std::string path;
+		long offset = 0;
+		long size = 0;
+		bool valid = false; // result: hash matches
+		Job* next = nullptr;
+	};
+
+	/**
+	 * @param threads count of worker threads, 0 = one per cpu core, at most
+	 * MAX_VERIFY_THREADS
+	 */
+	explicit VerifyPool(unsigned int threads = 0);
+	~VerifyPool();
+
+	/**
+	 * queue job for verification, the pool owns it until it's returned by
+	 * Collect()
+	 */
+	void Submit(Job* job);
+	/**
+	 * @return the finished jobs in the order they finished, linked with next,
+	 * nullptr if none. The caller has to delete them
+	 */
+	Job* Collect();
+	/**
+	 * block until all submitted jobs are finished
+	 */
+	void Wait();
+	/**
+	 * @return count of jobs which were submitted but not collected yet
+	 */
+	unsigned int Pending() const
+	{
+		return pending;
+	}
+
+private:
+	void Work();
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::condition_variable finished;
+	std::deque<Job*> jobs;
+	unsigned int running = 0; // jobs queued or hashed by a worker
+	bool stop = false;
+
+	std::atomic<Job*> done{nullptr}; // finished jobs, newest first
+	std::atomic<unsigned int> pending{0};
+};
+
+#endif
@@ -3,11 +3,18 @@
 #include "IDownloader.h"
 #include "Download.h"
 #include "Http/HttpDownloader.h"
+#include "Http/TransferLimit.h"
 #include "Rapid/RapidDownloader.h"
 #include "CurlWrapper.h"
 #include "Util.h"
 #include "Logger.h"
 #include "Mirror.h"
+#include "MirrorScore.h"
+#include "RateLimit.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
 
 class IDownloader;
 
@@ -29,9 +36,12 @@ void IDownloader::Shutdown()
 	httpdl = nullptr;
 	delete (rapiddl);
 	rapiddl = nullptr;
+	MirrorScore::Shutdown();
+	RateLimit::Shutdown();
+	TransferLimit::Shutdown();
 	CurlWrapper::KillCurl();
 }
-static bool abortDownloads = false;
+static std::atomic<bool> abortDownloads(false); // read by rapid + http threads
 void IDownloader::SetAbortDownloads(bool value)
 {
 	abortDownloads = value;
@@ -94,7 +104,35 @@ bool IDownloader::setOption(const std::string& key, const std::string& value)
 	return false;
 }
 
+static std::mutex progressMutex; // guards progress + the listener
+// done + total of the sources, kept until all are finished
+static std::map<const void*, std::pair<double, double>> progress;
+
 void IDownloader::setProcessUpdateListener(IDownloaderProcessUpdateListener l)
 {
+	std::lock_guard<std::mutex> lock(progressMutex);
 	IDownloader::listener = l;
 }
+
+void IDownloader::ReportProgress(const void* source, double done, double total)
+{
+	std::lock_guard<std::mutex> lock(progressMutex);
+	if (listener == nullptr) {
+		return;
+	}
+	progress[source] = std::make_pair(done, total);
+	double alldone = 0;
+	double alltotal = 0;
+	bool finished = true;
+	for (const auto& it : progress) {
+		alldone += it.second.first;
+		alltotal += it.second.second;
+		if (it.second.first < it.second.second) {
+			finished = false;
+		}
+	}
+	listener(alldone, alltotal);
+	if (finished) {
+		progress.clear();
+	}
+}
@@ -65,12 +65,16 @@ public:
 
 	virtual bool setOption(const std::string& key, const std::string& value);
 	static void setProcessUpdateListener(IDownloaderProcessUpdateListener l);
+	/**
+	 * reports the progress of source (i.e. a download) to the listener, which
+	 * gets the sum of all sources. Called by the rapid and the http thread,
+	 * the listener is called by one at a time
+	 */
+	static void ReportProgress(const void* source, double done, double total);
 
 private:
 	static IDownloader* httpdl;
 	static IDownloader* rapiddl;
-
-public:
 	static IDownloaderProcessUpdateListener listener;
 };
 
@@ -1,15 +1,80 @@
 /* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
 
 #include "Mirror.h"
+#include "MirrorScore.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <math.h>
+
+#define MIRROR_FAILURES 2      // failed transfers in a row which pause a mirror
+#define MIRROR_MAX_FAILURES 6  // failed transfers in a row which break a mirror
+#define MIRROR_BACKOFF 0.5     // seconds a mirror is paused after MIRROR_FAILURES, doubled by each failed probe
 
 Mirror::Mirror(const std::string& url_)
     : url(url_)
+    , host(MirrorScore::GetHost(url_))
 {
 }
 
-void Mirror::UpdateSpeed(int speed)
+void Mirror::AddSample(bool ok, double speed, double ttfb)
 {
-	if (speed > maxspeed) {
-		maxspeed = speed;
+	mirrorScore->AddSample(host, ok, speed, ttfb);
+	if (ok) {
+		TransferSucceeded();
+	} else {
+		TransferFailed(std::chrono::steady_clock::now());
 	}
 }
+
+double Mirror::GetBackoff() const
+{
+	return MIRROR_BACKOFF * pow(2, failures - MIRROR_FAILURES);
+}
+
+void Mirror::TransferFailed(time_point now)
+{
+	if (status == STATUS_BROKEN)
+		return;
+	if ((failures >= MIRROR_FAILURES) && !probing)
+		return; // started before the mirror was paused
+	probing = false;
+	failures++;
+	if (failures >= MIRROR_MAX_FAILURES) {
+		LOG_WARN("%s failed %u times, not used anymore", url.c_str(), failures);
+		status = STATUS_BROKEN;
+		return;
+	}
+	if (failures >= MIRROR_FAILURES) {
+		const double backoff = GetBackoff();
+		LOG_INFO("%s failed %u times, paused for %.1fs", url.c_str(), failures, backoff);
+		retry = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		    std::chrono::duration<double>(backoff));
+	}
+}
+
+void Mirror::TransferSucceeded()
+{
+	failures = 0;
+	probing = false;
+	retry = time_point();
+}
+
+void Mirror::TransferStarted(time_point now)
+{
+	if (failures < MIRROR_FAILURES)
+		return;
+	probing = true;
+	retry = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+	    std::chrono::duration<double>(GetBackoff()));
+}
+
+bool Mirror::IsUsable(time_point now) const
+{
+	return (status != STATUS_BROKEN) && (now >= retry);
+}
+
+double Mirror::ExpectedTime(long bytes) const
+{
+	return mirrorScore->ExpectedTime(host, bytes);
+}
@@ -3,20 +3,60 @@
 #ifndef _MIRROR_H
 #define _MIRROR_H
 
+#include <chrono>
 #include <string>
 
 class Mirror
 {
 public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
 	Mirror(const std::string& url_);
-	void UpdateSpeed(int speed);
+	/**
+	 * add the result of a finished transfer to the stats of the host and
+	 * to the failures of the mirror
+	 */
+	void AddSample(bool ok, double speed, double ttfb);
+	/**
+	 * a transfer from this mirror failed. After some failures in a row the
+	 * mirror is paused for a backoff time, which doubles with each failed
+	 * probe, when too many failed the mirror is broken
+	 */
+	void TransferFailed(time_point now);
+	void TransferSucceeded();
+	/**
+	 * a transfer from this mirror is started, when the mirror is paused it
+	 * probes the mirror and the next probe waits for another backoff time
+	 */
+	void TransferStarted(time_point now);
+	/**
+	 * @return true, if a transfer may be started at now
+	 */
+	bool IsUsable(time_point now) const;
+	/**
+	 * @return end of the pause of the mirror
+	 */
+	time_point GetRetryTime() const
+	{
+		return retry;
+	}
+	/**
+	 * expected seconds to receive bytes from this mirror, < 0 if unknown
+	 */
+	double ExpectedTime(long bytes) const;
 
 	enum MIRROR_STATUS { STATUS_BROKEN,
 			     STATUS_OK,
 			     STATUS_UNKNOWN };
 	MIRROR_STATUS status = STATUS_UNKNOWN;
 	std::string url;
-	int maxspeed = -1;
+	std::string host; // stats are kept per host, see MirrorScore
+
+private:
+	double GetBackoff() const;
+	unsigned int failures = 0; // failed transfers in a row
+	bool probing = false;	   // a transfer was started after the mirror was paused
+	time_point retry;	   // paused until then
 };
 
 #endif
@@ -0,0 +1,194 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "MirrorScore.h"
+#include "FileSystem/FileSystem.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+
+#define EWMA_ALPHA 0.3   // weight of a new sample
+#define MAX_ERROR_RATE 0.9 // hosts which always fail still get a (bad) score
+#define FAILED_HOST_TIME 3600.0 // seconds, hosts without a successful transfer
+#define HALF_LIFE (3 * 24 * 60 * 60) // seconds, see Decay()
+#define STATS_HEADER "# pr-downloader mirror stats v1"
+
+static MirrorScore* singleton = nullptr;
+
+MirrorScore* MirrorScore::GetInstance()
+{
+	if (singleton == nullptr) {
+		singleton = new MirrorScore();
+		const std::string path = GetPath();
+		if (fileSystem->fileExists(path)) {
+			singleton->Load(path);
+			singleton->Decay(time(nullptr));
+		}
+	}
+	return singleton;
+}
+
+void MirrorScore::Shutdown()
+{
+	if (singleton == nullptr)
+		return;
+	singleton->Save(GetPath());
+	delete singleton;
+	singleton = nullptr;
+}
+
+std::string MirrorScore::GetPath()
+{
+	return fileSystem->getSpringDir() + PATH_DELIMITER + "mirrorstats.txt";
+}
+
+bool MirrorScore::Read(const std::string& path, std::map<std::string, Stats>& res)
+{
+	FILE* f = fileSystem->propen(path, "r");
+	if (f == nullptr) {
+		return false;
+	}
+	char line[512];
+	char host[256];
+	while (fgets(line, sizeof(line), f) != nullptr) {
+		if (line[0] == '#')
+			continue;
+		Stats stats;
+		long long updated;
+		if (sscanf(line, "%255s %lf %lf %lf %u %lld", host, &stats.speed, &stats.ttfb,
+			   &stats.errors, &stats.samples, &updated) != 6) {
+			LOG_WARN("Invalid line in %s: %s", path.c_str(), line);
+			continue;
+		}
+		stats.updated = updated;
+		res[host] = stats;
+	}
+	fclose(f);
+	return true;
+}
+
+bool MirrorScore::Load(const std::string& path)
+{
+	std::map<std::string, Stats> res;
+	if (!Read(path, res)) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	hosts.swap(res);
+	LOG_DEBUG("Loaded stats of %d hosts from %s", hosts.size(), path.c_str());
+	return true;
+}
+
+bool MirrorScore::Save(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(saving);
+	// other processes merge their stats into the same file
+	CFileLock filelock(path);
+	std::map<std::string, Stats> res;
+	if (fileSystem->fileExists(path)) {
+		Read(path, res);
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		bool changed = false;
+		for (const auto& it : hosts) {
+			if (it.second.changed) {
+				res[it.first] = it.second;
+				changed = true;
+			}
+		}
+		if (!changed) {
+			return true;
+		}
+	}
+
+	std::string content = STATS_HEADER "\n";
+	for (const auto& it : res) {
+		const Stats& stats = it.second;
+		char line[128];
+		snprintf(line, sizeof(line), " %.1f %.4f %.4f %u %lld\n", stats.speed, stats.ttfb,
+			 stats.errors, stats.samples, (long long)stats.updated);
+		content += it.first + line;
+	}
+	return fileSystem->WriteFileAtomic(path, content);
+}
+
+void MirrorScore::Decay(time_t now)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto it = hosts.begin(); it != hosts.end();) {
+		Stats& stats = it->second;
+		const double age = std::max((double)(now - stats.updated), 0.0);
+		const double factor = pow(0.5, age / HALF_LIFE);
+		stats.errors *= factor;
+		stats.samples = (unsigned int)(stats.samples * factor + 0.5);
+		if (stats.samples == 0) {
+			it = hosts.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+static double Ewma(double avg, double sample)
+{
+	return avg + EWMA_ALPHA * (sample - avg);
+}
+
+void MirrorScore::AddSample(const std::string& host, bool ok, double speed, double ttfb)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Stats& stats = hosts[host];
+	if (stats.samples == 0) {
+		stats.errors = ok ? 0 : 1;
+	} else {
+		stats.errors = Ewma(stats.errors, ok ? 0 : 1);
+	}
+	if (ok && (speed > 0)) {
+		// the first successful transfer sets the averages
+		const bool first = stats.speed <= 0;
+		stats.speed = first ? speed : Ewma(stats.speed, speed);
+		stats.ttfb = first ? ttfb : Ewma(stats.ttfb, ttfb);
+	}
+	stats.samples++;
+	stats.updated = time(nullptr);
+	stats.changed = true;
+}
+
+MirrorScore::Stats MirrorScore::Get(const std::string& host) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<std::string, Stats>::const_iterator it = hosts.find(host);
+	if (it == hosts.end()) {
+		return Stats();
+	}
+	return it->second;
+}
+
+double MirrorScore::ExpectedTime(const std::string& host, long bytes) const
+{
+	const Stats stats = Get(host);
+	if (stats.samples == 0) {
+		return -1;
+	}
+	if (stats.speed <= 0) {
+		return FAILED_HOST_TIME;
+	}
+	const double time = stats.ttfb + std::max(bytes, 0L) / stats.speed;
+	// each failed transfer has to be repeated
+	return time / (1 - std::min(stats.errors, MAX_ERROR_RATE));
+}
+
+std::string MirrorScore::GetHost(const std::string& url)
+{
+	size_t start = url.find("://");
+	start = (start == std::string::npos) ? 0 : start + 3;
+	const size_t end = url.find('/', start);
+	std::string host = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+	const size_t at = host.rfind('@'); // strip user:password
+	if (at != std::string::npos) {
+		host = host.substr(at + 1);
+	}
+	return host;
+}
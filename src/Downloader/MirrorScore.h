@@ -0,0 +1,91 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef MIRROR_SCORE_H
+#define MIRROR_SCORE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <time.h>
+
+/**
+ * keeps exponentially weighted moving averages of the throughput, time to
+ * first byte and error rate of each host, shared by all mirrors on that host.
+ * The stats are stored in the spring dir, so the next run knows which
+ * mirrors are slow or dead
+ */
+class MirrorScore
+{
+public:
+	struct Stats {
+		double speed = 0;	// bytes/s of a transfer
+		double ttfb = 0;	// seconds until the first byte was received
+		double errors = 0;	// rate of failed transfers, 0..1
+		unsigned int samples = 0; // count of transfers seen
+		time_t updated = 0;	// time of the last sample
+		bool changed = false;	// got samples in this process
+	};
+
+	/**
+	 * returns the instance, the stats are loaded from the spring dir when
+	 * it's created
+	 */
+	static MirrorScore* GetInstance();
+	/**
+	 * saves the stats and deletes the instance
+	 */
+	static void Shutdown();
+
+	/**
+	 * loads the stats stored in path, replaces all known stats
+	 */
+	bool Load(const std::string& path);
+	/**
+	 * writes the stats of hosts which got samples to path, stats of other
+	 * hosts in path (i.e. written by another process) are kept
+	 */
+	bool Save(const std::string& path);
+	/**
+	 * let old stats fade: errors and the count of samples halve every
+	 * half-life since the last sample, hosts without samples left are
+	 * forgotten and will be probed again
+	 */
+	void Decay(time_t now);
+	/**
+	 * @return path of the stats in the spring dir
+	 */
+	static std::string GetPath();
+
+	/**
+	 * add the result of a finished transfer from host
+	 * @param ok false, if the transfer failed or received invalid data
+	 * @param speed bytes/s, only used if ok
+	 * @param ttfb seconds until the first byte was received, only used if ok
+	 */
+	void AddSample(const std::string& host, bool ok, double speed, double ttfb);
+	/**
+	 * @return the stats of host, samples is 0 if it wasn't seen yet
+	 */
+	Stats Get(const std::string& host) const;
+	/**
+	 * expected seconds to receive bytes from host, including the time lost by
+	 * failed transfers. Hosts without a successful transfer get a very long
+	 * time, so they're only used when no other host is left
+	 * @return the expected time, < 0 if nothing is known about host yet
+	 */
+	double ExpectedTime(const std::string& host, long bytes) const;
+	/**
+	 * @return host[:port] of url
+	 */
+	static std::string GetHost(const std::string& url);
+
+private:
+	static bool Read(const std::string& path, std::map<std::string, Stats>& res);
+	std::map<std::string, Stats> hosts;
+	mutable std::mutex mutex;
+	std::mutex saving; // Save() may be called by downloads in several threads
+};
+
+#define mirrorScore MirrorScore::GetInstance()
+
+#endif
@@ -6,6 +6,7 @@
 #include "Logger.h"
 #include "Repo.h"
 #include "Sdp.h"
+#include "Downloader/Http/HttpDownloader.h"
 
 #include <stdio.h>
 #include <string>
@@ -23,6 +24,7 @@
 
 CRapidDownloader::CRapidDownloader()
     : reposgzurl(REPO_MASTER)
+    , http(new CHttpDownloader())
 {
 }
 
@@ -67,7 +69,7 @@ bool CRapidDownloader::download_name(IDownload* download, int reccounter,
 
 		LOG_INFO ("[Download] %s", sdp.getName().c_str());
 
-		if (!sdp.download(download)) {
+		if (!sdp.download(download, http.get())) {
 			return false;
 		}
 		if (sdp.getDepends().empty()) {
@@ -159,7 +161,8 @@ bool CRapidDownloader::UpdateReposGZ()
 		return true;
 	IDownload dl(path);
 	dl.addMirror(reposgzurl);
-	return httpDownload->download(&dl) && parse();
+	dl.priority = RateLimit::PRIORITY_HIGH;
+	return http->download(&dl) && parse();
 }
 
 static bool ParseFD(FILE* f, const std::string& path, std::list<CRepo>& repos, CRapidDownloader* rapid)
@@ -234,7 +237,7 @@ bool CRapidDownloader::updateRepos(const std::string& searchstr)
 		dls.push_back(dl);
 	}
 	LOG_DEBUG("Downloading ...");
-	httpDownload->download(dls);
+	http->download(dls);
 	for (CRepo* repo : usedrepos) {
 		repo->parse();
 	}
@@ -7,6 +7,7 @@
 
 #include <string>
 #include <list>
+#include <memory>
 #include <stdio.h>
 
 #define REPO_MASTER_RECHECK_TIME \
@@ -55,6 +56,9 @@ private:
 	std::string path;
 	std::string reposgzurl;
 	std::list<CRepo> repos;
+	// repos + sdp files are downloaded by an own instance, so rapid
+	// downloads can run in a thread beside the http downloads
+	std::unique_ptr<IDownloader> http;
 
 	/**
           download by name, for example "Complete Annihilation revision 1234"
@@ -34,6 +34,7 @@ bool CRepo::getDownload(IDownload& dl)
 
 	dl = IDownload(tmpFile);
 	dl.addMirror(repourl + "/versions.gz");
+	dl.priority = RateLimit::PRIORITY_HIGH;
 	return true;
 }
 
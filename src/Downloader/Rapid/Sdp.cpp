@@ -13,10 +13,19 @@
 #include "Logger.h"
 #include "FileSystem/FileSystem.h"
 #include "FileSystem/FileData.h"
+#include "FileSystem/PoolIndex.h"
+#include "FileSystem/ValidationLedger.h"
 #include "FileSystem/HashMD5.h"
+#include "FileSystem/HashGzipMD5.h"
 #include "FileSystem/File.h"
 #include "Downloader/CurlWrapper.h"
+#include "Downloader/CurlPool.h"
 #include "Downloader/Download.h"
+#include "Downloader/MirrorScore.h"
+#include "Downloader/RateLimit.h"
+
+#define POOL_BATCH 64 // received pool files which are written and closed at once
+#define POOL_BATCH_SIZE (16 * 1024 * 1024) // bytes of them kept in memory
 
 CSdp::CSdp(const std::string& shortname, const std::string& md5,
 	   const std::string& name, const std::string& depends,
@@ -41,27 +50,13 @@ CSdp::CSdp(CSdp&& sdp) = default;
 
 CSdp::~CSdp() = default;
 
-bool createPoolDirs(const std::string& root)
-{
-	for (int i = 0; i < 256; i++) {
-		char buf[1024];
-		const int len = snprintf(buf, sizeof(buf), "%s%02x%c", root.c_str(), i, PATH_DELIMITER);
-		const std::string tmp(buf, len);
-		if ((!fileSystem->directoryExists(tmp)) &&
-		    (!fileSystem->createSubdirs(tmp))) {
-			LOG_ERROR("Couldn't create %s", tmp.c_str());
-			return false;
-		}
-	}
-	return true;
-}
-
-bool CSdp::downloadSelf(IDownload* /*dl*/)
+bool CSdp::downloadSelf(IDownloader* http)
 {
 	const std::string tmpFile = sdpPath + ".tmp";
 	IDownload tmpdl(tmpFile);
 	tmpdl.addMirror(baseUrl + "/packages/" + md5 + ".sdp");
-	if(!httpDownload->download(&tmpdl)) {
+	tmpdl.priority = RateLimit::PRIORITY_HIGH;
+	if(!http->download(&tmpdl)) {
 		LOG_ERROR("Couldn't download %s", (md5 + ".sdp").c_str());
 		return false;
 	}
@@ -75,44 +70,23 @@ bool CSdp::downloadSelf(IDownload* /*dl*/)
 	return true;
 }
 
-bool CSdp::download(IDownload* dl)
+bool CSdp::download(IDownload* dl, IDownloader* http)
 {
 	if (downloaded) // allow download only once of the same sdp
 		return true;
 	m_download = dl;
 	if ((!fileSystem->fileExists(sdpPath)) || (!fileSystem->parseSdp(sdpPath, files))) {// parse downloaded file
-		if (!downloadSelf(dl))
+		if (!downloadSelf(http))
 			return false;
 		fileSystem->parseSdp(sdpPath, files);
 	}
 
-	int i = 0;
-	int count = 0;
-	for (FileData& filedata: files) { // check which file are available on local
-	                                   // disk -> create list of files to download
-		HashMD5 fileMd5;
-		i++;
-		fileMd5.Set(filedata.md5, sizeof(filedata.md5));
-		const std::string file = fileSystem->getPoolFilename(fileMd5.toString());
-		if (!fileSystem->fileExists(file)) { // add non-existing files to download list
-			count++;
-			filedata.download = true;
-		} else {
-			filedata.download = false;
-		}
-		if (i % 30 == 0) {
-			LOG_DEBUG("%d/%d checked", i, (int)files.size());
-		}
-	}
-	LOG_DEBUG("%d/%d need to download %d files", i, (int)files.size(),
-		  count);
+	// check which file are available on local disk -> create list of files
+	// to download, the pool directories are created by the index
+	const int count = poolIndex->MarkMissing(files);
+	LOG_DEBUG("need to download %d/%d files", count, (int)files.size());
 
-	const std::string root = fileSystem->getSpringDir() + PATH_DELIMITER + "pool" + PATH_DELIMITER;
-	if (!createPoolDirs(root)) {
-		LOG_ERROR("Creating pool directories failed");
-		return false;
-	}
-	if (!downloadStream()) {
+	if ((count > 0) && !downloadStream()) {
 		LOG_ERROR("Couldn't download files for %s", md5.c_str());
 		fileSystem->removeFile(sdpPath);
 		return false;
@@ -120,7 +94,8 @@ bool CSdp::download(IDownload* dl)
 	LOG_DEBUG("Sucessfully downloaded %d files: %s %s", count,
 		  shortname.c_str(), name.c_str());
 
-	if (!fileSystem->validateSDP(sdpPath)) { //FIXME: in this call only the downloaded files should be checked
+	// files which were downloaded were verified already
+	if (!fileSystem->validateFiles(files)) {
 		LOG_ERROR("Validation failed");
 		return false;
 	}
@@ -151,7 +126,9 @@ static bool OpenNextFile(CSdp& sdp)
 	assert(fd.size + 5000 >= fd.compsize); // compressed file should be smaller than uncompressed file
 
 	fileMd5.Set(fd.md5, sizeof(fd.md5));
-	sdp.file_name = fileSystem->getPoolFilename(fileMd5.toString());
+	const std::string md5 = fileMd5.toString();
+	sdp.file_name = fileSystem->getPoolFilename(md5);
+	poolIndex->Prepare(md5);
 	sdp.file_handle = std::unique_ptr<CFile>(new CFile());
 	if (sdp.file_handle == nullptr) {
 		LOG_ERROR("couldn't open %s", fd.name.c_str());
@@ -159,6 +136,10 @@ static bool OpenNextFile(CSdp& sdp)
 	}
 	sdp.file_handle->Open(sdp.file_name, fd.compsize);
 	sdp.file_pos = 0;
+	if (sdp.file_md5 == nullptr) {
+		sdp.file_md5.reset(new HashGzipMD5());
+	}
+	sdp.file_md5->Init();
 	return true;
 }
 
@@ -178,15 +159,38 @@ static int GetLength(CSdp& sdp, const char* const buf_pos, const char* const buf
 	return toskip;
 }
 
-static void SafeCloseFile(CSdp& sdp)
+static bool SafeCloseFile(CSdp& sdp)
 {
 	if (sdp.file_handle == nullptr)
-		return;
+		return true;
 
-	sdp.file_handle->Close();
+	const bool ok = sdp.file_handle->Close();
 	sdp.file_handle = nullptr;
 	sdp.file_pos = 0;
 	sdp.skipped = 0;
+	return ok;
+}
+
+// writes and closes the received files, then adds them to the pool index
+static bool ClosePending(CSdp& sdp)
+{
+	std::vector<CFile*> files;
+	for (const CSdp::PendingFile& file : sdp.pending) {
+		files.push_back(file.handle.get());
+	}
+	const bool ok = CFile::CloseAll(files);
+	for (const CSdp::PendingFile& file : sdp.pending) {
+		if (file.handle->HasError())
+			continue;
+		poolIndex->Add(file.md5);
+		ValidationLedger::Stat stat;
+		if (ValidationLedger::GetStat(file.name, stat)) {
+			validationLedger->Add(file.md5, stat);
+		}
+	}
+	sdp.pending.clear();
+	sdp.pending_size = 0;
+	return ok;
 }
 
 static int WriteData(CSdp& sdp, const char* const buf_pos, const char* const buf_end)
@@ -204,20 +208,36 @@ static int WriteData(CSdp& sdp, const char* const buf_pos, const char* const buf
 	}
 	if (res > 0) {
 		sdp.file_pos += res;
+		sdp.file_md5->Update(buf_pos, res);
 	}
-	if (res != towrite) {
+	if (res != towrite) { // i.e. disk full, the download fails
 		LOG_ERROR("fwrite error");
-		return false;
+		return -1;
 	}
 
 	// file finished -> next file
 	if (sdp.file_pos >= fd.compsize) {
-		SafeCloseFile(sdp);
-		if (!fileSystem->fileIsValid(&fd, sdp.file_name.c_str())) {
+		// verified as it was received, the file isn't read again
+		sdp.file_md5->Final();
+		if (!sdp.file_md5->compare(fd.md5, sizeof(fd.md5))) {
 			LOG_ERROR("File is broken?!: %s", sdp.file_name.c_str());
+			SafeCloseFile(sdp);
 			fileSystem->removeFile(sdp.file_name.c_str());
 			return -1;
 		}
+		sdp.list_it->verified = true;
+		CSdp::PendingFile file;
+		file.handle = std::move(sdp.file_handle);
+		file.md5 = sdp.file_md5->toString(fd.md5, sizeof(fd.md5));
+		file.name = sdp.file_name;
+		sdp.pending.push_back(std::move(file));
+		sdp.pending_size += fd.compsize;
+		sdp.file_pos = 0;
+		sdp.skipped = 0;
+		if (((sdp.pending.size() >= POOL_BATCH) || (sdp.pending_size >= POOL_BATCH_SIZE)) &&
+		    !ClosePending(sdp)) {
+			return -1;
+		}
 		++sdp.list_it;
 		memset(sdp.cursize_buf, 0, 4); //safety
 	}
@@ -247,6 +267,7 @@ static size_t write_streamed_data(const void* buf, size_t size, size_t nmemb, CS
 
 	if (IDownloader::AbortDownloads())
 		return -1;
+	rateLimit->Wait(sdp.host, sdp.m_download, sdp.m_download->priority, size * nmemb);
 	const char* buf_start = (const char*)buf;
 	const char* buf_end = buf_start + size * nmemb;
 	const char* buf_pos = buf_start;
@@ -300,14 +321,13 @@ static int progress_func(CSdp& sdp, double TotalToDownload,
 		total += it.second;
 	}
 	sdp.m_download->size = total;
-	if (IDownloader::listener != nullptr) {
-		IDownloader::listener(NowDownloaded, TotalToDownload);
-	}
 	total = 0;
 	for (auto it : sdp.m_download->map_rapid_progress) {
 		total += it.second;
 	}
 	sdp.m_download->progress = total;
+	IDownloader::ReportProgress(sdp.m_download, sdp.m_download->progress,
+				    sdp.m_download->size);
 	if (TotalToDownload == NowDownloaded) // force output when download is
 					      // finished
 		LOG_PROGRESS(NowDownloaded, TotalToDownload, true);
@@ -319,13 +339,14 @@ static int progress_func(CSdp& sdp, double TotalToDownload,
 bool CSdp::downloadStream()
 {
 	std::string downloadUrl = baseUrl + "/streamer.cgi?" + md5;
-	CurlWrapper curlw;
+	std::unique_ptr<CurlWrapper> curlw = CurlPool::Acquire();
+	host = MirrorScore::GetHost(baseUrl);
 
 	CURLcode res;
 	LOG_INFO("Using rapid");
 	LOG_INFO(downloadUrl.c_str());
 
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_URL, downloadUrl.c_str());
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_URL, downloadUrl.c_str());
 
 	SafeCloseFile(*this);
 
@@ -349,23 +370,30 @@ bool CSdp::downloadStream()
 
 	gzip_str(&buf[0], buflen, &dest[0], &destlen);
 
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_WRITEFUNCTION, write_streamed_data);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_WRITEDATA, this);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_POSTFIELDS, &dest[0]);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_POSTFIELDSIZE, destlen);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_NOPROGRESS, 0L);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_XFERINFOFUNCTION, progress_func);
-	curl_easy_setopt(curlw.GetHandle(), CURLOPT_PROGRESSDATA, this);
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_WRITEFUNCTION, write_streamed_data);
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_WRITEDATA, this);
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_POSTFIELDS, &dest[0]);
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_POSTFIELDSIZE, destlen);
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_XFERINFOFUNCTION, progress_func);
+	curl_easy_setopt(curlw->GetHandle(), CURLOPT_PROGRESSDATA, this);
 
-	res = curl_easy_perform(curlw.GetHandle());
+	res = curl_easy_perform(curlw->GetHandle());
 
 	SafeCloseFile(*this);
+	const bool closed = ClosePending(*this); // received before an error, too
+	CurlPool::Release(std::move(curlw));
+	rateLimit->RemoveDownload(m_download);
 
 	/* always cleanup */
 	if (res != CURLE_OK) {
 		LOG_ERROR("Curl error: %s", curl_easy_strerror(res));
 		return false;
 	}
+	if (!closed) {
+		LOG_ERROR("Couldn't write the files of %s", md5.c_str());
+		return false;
+	}
 
 
 	return true;
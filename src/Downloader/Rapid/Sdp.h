@@ -6,13 +6,16 @@
 #include <list>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "FileSystem/FileData.h"
 
 #define LENGTH_SIZE 4
 
 class IDownload;
+class IDownloader;
 class CFile;
+class HashGzipMD5;
 
 class CSdp
 {
@@ -28,11 +31,11 @@ public:
      md5 of the sdp file
           we have to download the sdp + parse it + download associated files
   */
-	bool download(IDownload* dl);
+	bool download(IDownload* dl, IDownloader* http);
 	/**
           download the sdp file if it doesn't exist yet
   */
-	bool downloadSelf(IDownload* dl);
+	bool downloadSelf(IDownloader* http);
 	/**
           returns md5 of a repo
   */
@@ -66,12 +69,23 @@ public:
 	std::list<FileData>::iterator list_it;
 	std::list<FileData> files; // list with all files of an sdp
 	std::unique_ptr<CFile> file_handle;
+	std::unique_ptr<HashGzipMD5> file_md5; // of the file being received
 	std::string file_name;
 
+	// received and verified files, they're written and closed in batches
+	struct PendingFile {
+		std::unique_ptr<CFile> handle;
+		std::string md5;
+		std::string name;
+	};
+	std::vector<PendingFile> pending;
+	long pending_size = 0;
+
 	unsigned int file_pos = 0;
 	unsigned int skipped = 0;
 	unsigned char cursize_buf[LENGTH_SIZE];
 	unsigned int cursize = 0;
+	std::string host; // of baseUrl, for the bandwidth limit
 
 private:
 	void parse();
@@ -0,0 +1,126 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "RateLimit.h"
+#include "IDownloader.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <thread>
+
+#define BURST_TIME 0.5 // seconds of data a bucket holds
+#define MIN_BURST (16 * 1024) // CURL_MAX_WRITE_SIZE, so a write callback fits
+#define MAX_SLEEP 0.1 // seconds, aborts are noticed while waiting
+
+static RateLimit* singleton = nullptr;
+
+RateLimit* RateLimit::GetInstance()
+{
+	if (singleton == nullptr) {
+		singleton = new RateLimit();
+	}
+	return singleton;
+}
+
+void RateLimit::Shutdown()
+{
+	delete singleton;
+	singleton = nullptr;
+}
+
+void RateLimit::SetLimit(Budget budget, long rate)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	rates[budget] = std::max(rate, 0L);
+	LOG_INFO("Bandwidth limit %d: %ld bytes/s", budget, rates[budget]);
+}
+
+long RateLimit::GetLimit(Budget budget) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return rates[budget];
+}
+
+static double GetBurst(long rate)
+{
+	return std::max(rate * BURST_TIME, (double)MIN_BURST);
+}
+
+void RateLimit::Refill(Bucket& bucket, long rate, time_point now)
+{
+	const double elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+	bucket.tokens = std::min(bucket.tokens + rate * elapsed, GetBurst(rate));
+	bucket.updated = now;
+}
+
+double RateLimit::GetWait(Bucket& bucket, long rate, Priority priority, time_point now)
+{
+	if (rate <= 0)
+		return 0;
+	Refill(bucket, rate, now);
+	// high priority transfers may overdraw the bucket
+	const double min = (priority == PRIORITY_HIGH) ? -GetBurst(rate) : 0;
+	if (bucket.tokens >= min)
+		return 0;
+	return (min - bucket.tokens) / rate;
+}
+
+RateLimit::Bucket* RateLimit::GetBucket(Budget budget, const std::string& host,
+					const void* download)
+{
+	switch (budget) {
+		case BUDGET_TOTAL:
+			return &total;
+		case BUDGET_HOST:
+			return &hosts[host];
+		case BUDGET_DOWNLOAD:
+			return (download != nullptr) ? &downloads[download] : nullptr;
+	}
+	return nullptr;
+}
+
+double RateLimit::GetWait(const std::string& host, const void* download, Priority priority)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const time_point now = std::chrono::steady_clock::now();
+	double wait = 0;
+	for (int i = BUDGET_TOTAL; i <= BUDGET_DOWNLOAD; i++) {
+		if (rates[i] <= 0)
+			continue;
+		Bucket* bucket = GetBucket((Budget)i, host, download);
+		if (bucket != nullptr)
+			wait = std::max(wait, GetWait(*bucket, rates[i], priority, now));
+	}
+	return wait;
+}
+
+void RateLimit::Take(const std::string& host, const void* download, size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const time_point now = std::chrono::steady_clock::now();
+	for (int i = BUDGET_TOTAL; i <= BUDGET_DOWNLOAD; i++) {
+		if (rates[i] <= 0)
+			continue;
+		Bucket* bucket = GetBucket((Budget)i, host, download);
+		if (bucket == nullptr)
+			continue;
+		Refill(*bucket, rates[i], now);
+		bucket->tokens -= bytes;
+	}
+}
+
+void RateLimit::Wait(const std::string& host, const void* download, Priority priority,
+		     size_t bytes)
+{
+	double wait = GetWait(host, download, priority);
+	while ((wait > 0) && !IDownloader::AbortDownloads()) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(std::min(wait, MAX_SLEEP)));
+		wait = GetWait(host, download, priority);
+	}
+	Take(host, download, bytes);
+}
+
+void RateLimit::RemoveDownload(const void* download)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	downloads.erase(download);
+}
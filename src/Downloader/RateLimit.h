@@ -0,0 +1,77 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <string>
+
+/**
+ * limits the bandwidth used with token buckets: one for all transfers, one
+ * for each host and one for each download. Received data is taken from the
+ * buckets, when a bucket is empty its transfers wait until it was refilled.
+ * High priority transfers (i.e. metadata) may overdraw the buckets by one
+ * burst, bulk transfers wait until that was paid back, so metadata is
+ * received first
+ */
+class RateLimit
+{
+public:
+	enum Priority { PRIORITY_HIGH,
+			PRIORITY_NORMAL };
+	enum Budget { BUDGET_TOTAL, // all transfers
+		      BUDGET_HOST,  // each host
+		      BUDGET_DOWNLOAD }; // each download
+
+	static RateLimit* GetInstance();
+	static void Shutdown();
+
+	/**
+	 * sets the limit of a budget, can be changed while transfers run
+	 * @param rate bytes/s, <= 0 = unlimited
+	 */
+	void SetLimit(Budget budget, long rate);
+	long GetLimit(Budget budget) const;
+	/**
+	 * @param download identifies the download, nullptr if it's not part of one
+	 * @return seconds to wait, before a transfer of download from host may
+	 * receive more data
+	 */
+	double GetWait(const std::string& host, const void* download, Priority priority);
+	/**
+	 * takes received bytes from the budgets
+	 */
+	void Take(const std::string& host, const void* download, size_t bytes);
+	/**
+	 * waits until data may be received, then takes the bytes, for transfers
+	 * which are run by curl_easy_perform
+	 */
+	void Wait(const std::string& host, const void* download, Priority priority, size_t bytes);
+	/**
+	 * forgets the bucket of a finished download
+	 */
+	void RemoveDownload(const void* download);
+
+private:
+	typedef std::chrono::steady_clock::time_point time_point;
+	struct Bucket {
+		double tokens = 0; // bytes which may be received, < 0 when overdrawn
+		time_point updated;
+	};
+	Bucket* GetBucket(Budget budget, const std::string& host, const void* download);
+	static double GetWait(Bucket& bucket, long rate, Priority priority, time_point now);
+	static void Refill(Bucket& bucket, long rate, time_point now);
+
+	long rates[BUDGET_DOWNLOAD + 1] = {0, 0, 0};
+	Bucket total;
+	std::map<std::string, Bucket> hosts;
+	std::map<const void*, Bucket> downloads;
+	mutable std::mutex mutex;
+};
+
+#define rateLimit RateLimit::GetInstance()
+
+#endif
@@ -4,6 +4,7 @@
 #include "FileSystem.h"
 #include "Logger.h"
 #include "IHash.h"
+#include "IoRing.h"
 #include "Util.h"
 
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include <io.h> //_chsize
 #endif
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -20,6 +22,9 @@
 #include <sys/time.h>
 #endif
 #include <algorithm> //std::min
+#include <atomic>
+#include <deque>
+#include <thread>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -29,41 +34,309 @@
 #define lutimes utimes
 #endif
 
+#define WRITE_BLOCK (1024 * 1024) // buffered data is written in blocks of this size
+#define WRITE_ALIGN (64 * 1024) // blocks end at multiples of this offset
+#define MAX_QUEUED (32 * 1024 * 1024) // bytes waiting for the writer thread
+#define MAX_BUFFERED (64 * 1024 * 1024) // bytes buffered for all files
+#define WRITE_BATCH 64 // blocks written at once by the writer thread
+#define PREALLOCATE_MIN_SIZE (4 * 1024 * 1024) // smaller files without pieces aren't preallocated
+
+#ifdef _WIN32
+#define OPEN_FLAGS O_BINARY
+#else
+#define OPEN_FLAGS O_CLOEXEC
+#endif
+
+static int OpenFd(const std::string& path, int flags)
+{
+#ifdef _WIN32
+	const int fd = _wopen(s2ws(path).c_str(), flags | OPEN_FLAGS, _S_IREAD | _S_IWRITE);
+#else
+	const int fd = open(path.c_str(), flags | OPEN_FLAGS, 0644);
+#endif
+	if (fd < 0) {
+		LOG_ERROR("Couldn't open %s: %s", path.c_str(), strerror(errno));
+	}
+	return fd;
+}
+
+// sets the size of the file and reserves its blocks, so pieces which are
+// written out of order don't fragment it. When the file system can't
+// preallocate, the file is sparse and blocks are allocated while writing
+static bool Allocate(int fd, long size)
+{
+#ifdef _MSC_VER
+	if (_chsize(fd, size) != 0) { // allocates the extended range
+		return false;
+	}
+#else
+	if (ftruncate(fd, size) != 0) {
+		return false;
+	}
+#endif
+#if defined(__linux__)
+	if (fallocate(fd, 0, 0, size) != 0) {
+		if (errno == ENOSPC) {
+			return false;
+		}
+		LOG_DEBUG("fallocate() failed: %s", strerror(errno));
+	}
+#elif defined(F_PREALLOCATE)
+	fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, size, 0};
+	if (fcntl(fd, F_PREALLOCATE, &store) != 0) {
+		if (errno == ENOSPC) {
+			return false;
+		}
+		LOG_DEBUG("F_PREALLOCATE failed: %s", strerror(errno));
+	}
+#endif
+	return true;
+}
+
+// reads len bytes, fails on EOF
+static bool ReadFully(int fd, char* buf, int len, long offset)
+{
+	while (len > 0) {
+		const long res = IoRing::ReadAt(fd, buf, len, offset);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return false;
+		buf += res;
+		len -= res;
+		offset += res;
+	}
+	return true;
+}
+
+static std::atomic<size_t> buffered(0); // bytes of all runs + queued blocks
+static std::atomic<size_t> queuedBytes(0);
+
+/**
+ * writes the blocks of all files in the order they were submitted, so the
+ * callbacks which receive the data don't wait for the disk. Queued blocks are
+ * written together through io_uring, if available
+ */
+class WriteBehind
+{
+public:
+	struct Block {
+		CFile* file;
+		long offset;
+		std::string data;
+	};
+
+	static WriteBehind& GetInstance()
+	{
+		static WriteBehind instance;
+		return instance;
+	}
+
+	void Submit(Block* block)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			blocks.push_back(block);
+		}
+		queued.notify_one();
+	}
+
+private:
+	WriteBehind()
+	    : writer(&WriteBehind::Work, this)
+	{
+	}
+
+	~WriteBehind()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		queued.notify_all();
+		writer.join();
+	}
+
+	// blocks of the same file which overlap have to be written in order
+	static bool Overlaps(const Block* a, const Block* b)
+	{
+		return (a->file == b->file) &&
+		       (a->offset < b->offset + (long)b->data.size()) &&
+		       (b->offset < a->offset + (long)a->data.size());
+	}
+
+	void Work()
+	{
+		IoRing ring(WRITE_BATCH);
+		std::vector<Block*> batch;
+		std::vector<IoRing::Op> ops;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queued.wait(lock, [this] { return stop || !blocks.empty(); });
+				if (blocks.empty()) {
+					return;
+				}
+				// all queued blocks are written with one syscall
+				batch.clear();
+				while (!blocks.empty() && (batch.size() < WRITE_BATCH)) {
+					Block* block = blocks.front();
+					bool overlaps = false;
+					for (const Block* other : batch) {
+						overlaps = overlaps || Overlaps(block, other);
+					}
+					if (overlaps)
+						break;
+					batch.push_back(block);
+					blocks.pop_front();
+				}
+			}
+			ops.resize(batch.size());
+			for (size_t i = 0; i < batch.size(); i++) {
+				ops[i].code = IoRing::OP_WRITE;
+				ops[i].fd = batch[i]->file->handle;
+				ops[i].buf = &batch[i]->data[0];
+				ops[i].len = batch[i]->data.size();
+				ops[i].offset = batch[i]->offset;
+			}
+			ring.Run(ops);
+			for (size_t i = 0; i < batch.size(); i++) {
+				Block* block = batch[i];
+				CFile* file = block->file;
+				const size_t len = block->data.size();
+				int error = 0;
+				if ((size_t)ops[i].result != len) {
+					error = (ops[i].result < 0) ? -ops[i].result : EIO;
+					LOG_ERROR("write error %s: %s", file->filename.c_str(), strerror(error));
+				}
+				buffered -= len;
+				queuedBytes -= len;
+				delete block;
+				// notified while locked, the file may be closed as soon as it's unlocked
+				std::lock_guard<std::mutex> lock(file->mutex);
+				if (file->error == 0) {
+					file->error = error;
+				}
+				file->queued--;
+				file->written.notify_all();
+			}
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::deque<Block*> blocks;
+	bool stop = false;
+	std::thread writer; // started after the members it uses
+};
+
 CFile::~CFile()
 {
-	// TODO: write buffered data
 	Close();
 }
 
-void CFile::Close()
+bool CFile::Close()
 {
-	if (handle != nullptr) {
-		LOG_DEBUG("closing %s", filename.c_str());
-		if ((piecesize != -1) && (size != -1)) {
-			assert(GetSizeFromHandle() == size);
+	if (handle < 0) {
+		return true;
+	}
+	LOG_DEBUG("closing %s", filename.c_str());
+	const bool ok = Flush();
+	if ((piecesize != -1) && (size != -1)) {
+		assert(GetSizeFromHandle() == size);
+	}
+
+	close(handle);
+	handle = -1;
+	return Finish(ok);
+}
+
+bool CFile::Finish(bool ok)
+{
+	if (!ok) { // incomplete, the destination isn't replaced
+		LOG_ERROR("Couldn't write %s: %s", filename.c_str(), strerror(error));
+		return false;
+	}
+	if (IsNewFile()) {
+		if (fileSystem->fileExists(
+			filename)) { // delete possible existing destination file
+			fileSystem->removeFile(filename);
 		}
+		fileSystem->Rename(tmpfile, filename);
+		isnewfile = false;
+	}
+	return true;
+}
 
-		fclose(handle);
-		handle = nullptr;
-		if (IsNewFile()) {
-			if (fileSystem->fileExists(
-				filename)) { // delete possible existing destination file
-				fileSystem->removeFile(filename);
-			}
-			fileSystem->Rename(tmpfile, filename);
-			isnewfile = false;
+bool CFile::CloseAll(const std::vector<CFile*>& files)
+{
+	static thread_local IoRing ring(WRITE_BATCH); // not thread safe
+	std::vector<IoRing::Op> ops;
+	std::vector<CFile*> owners; // file of each op
+	for (CFile* file : files) {
+		if (file->handle < 0)
+			continue;
+		std::unique_lock<std::mutex> lock(file->mutex);
+		file->written.wait(lock, [file] { return file->queued == 0; });
+		for (Run& run : file->runs) {
+			if (file->error != 0)
+				break;
+			IoRing::Op op;
+			op.code = IoRing::OP_WRITE;
+			op.fd = file->handle;
+			op.buf = &run.data[0];
+			op.len = run.data.size();
+			op.offset = run.offset;
+			ops.push_back(op);
+			owners.push_back(file);
+		}
+	}
+	ring.Run(ops);
+	for (size_t i = 0; i < ops.size(); i++) {
+		CFile* file = owners[i];
+		if (((size_t)ops[i].result != ops[i].len) && (file->error == 0)) {
+			file->error = (ops[i].result < 0) ? -ops[i].result : EIO;
+			LOG_ERROR("write error %s: %s", file->filename.c_str(), strerror(file->error));
+		}
+	}
+
+	ops.clear();
+	owners.clear();
+	for (CFile* file : files) {
+		if (file->handle < 0)
+			continue;
+		LOG_DEBUG("closing %s", file->filename.c_str());
+		for (const Run& run : file->runs) {
+			buffered -= run.data.size();
+		}
+		file->runs.clear();
+		if ((file->piecesize != -1) && (file->size != -1)) {
+			assert(file->GetSizeFromHandle() == file->size);
 		}
+		IoRing::Op op;
+		op.code = IoRing::OP_CLOSE;
+		op.fd = file->handle;
+		ops.push_back(op);
+		owners.push_back(file);
 	}
+	ring.Run(ops);
+	bool res = true;
+	for (CFile* file : owners) {
+		file->handle = -1;
+		res = file->Finish(file->error == 0) && res;
+	}
+	return res;
 }
 
-bool CFile::Open(const std::string& filename, long size, int piecesize)
+bool CFile::Open(const std::string& filename, long size, int piecesize, bool resume)
 {
 	LOG_DEBUG("%s %d %d", filename.c_str(), size, piecesize);
 	this->filename = filename;
 	this->size = size;
+	error = 0;
 	fileSystem->createSubdirs(CFileSystem::DirName(filename));
 	SetPieceSize(piecesize);
-	assert(handle == nullptr);
+	assert(handle < 0);
 
 #if defined(__WIN32__) || defined(_MSC_VER)
 	struct _stat sb;
@@ -77,34 +350,45 @@ bool CFile::Open(const std::string& filename, long size, int piecesize)
 	isnewfile = res != 0;
 	if (isnewfile) { // if file is new, create it, if not, open the existing one
 			 // without truncating it
-		tmpfile = filename + ".tmp";
-		handle = fileSystem->propen(tmpfile, "wb+");
+		tmpfile = GetTmpPath(filename);
+		resume = resume && fileSystem->fileExists(tmpfile);
+		if (resume) {
+#if defined(__WIN32__) || defined(_MSC_VER)
+			res = _wstat(s2ws(tmpfile).c_str(), &sb);
+#else
+			res = stat(tmpfile.c_str(), &sb);
+#endif
+			handle = (res == 0) ? OpenFd(tmpfile, O_RDWR) : -1;
+		} else {
+			handle = OpenFd(tmpfile, O_RDWR | O_CREAT | O_TRUNC);
+		}
 	} else {
-		handle = fileSystem->propen(filename, "rb+");
+		handle = OpenFd(filename, O_RDWR);
 		timestamp = sb.st_mtime;
 	}
-	if (handle == nullptr) {
-		LOG_ERROR("open(%s): %s", filename.c_str(), strerror(errno));
+	if (handle < 0) {
 		return false;
 	}
 
-	if ((!isnewfile) && (size > 0) &&
-	    (size !=
-	     sb.st_size)) { // truncate file if real-size != excepted file size
-#ifdef _MSC_VER
-		const int ret = _chsize(fileno(handle), size);
-#else
-		const int ret = ftruncate(fileno(handle), size);
-#endif
-
-		if (ret != 0) {
-			LOG_ERROR("ftruncate failed %s", filename.c_str());
+	const bool created = isnewfile && !resume;
+	const bool mismatch = !created && (size != sb.st_size);
+	// small files without pieces (i.e. of the rapid pool) are written in
+	// order, preallocating them only costs syscalls
+	if ((size > 0) && (mismatch || (created && (!pieces.empty() || (size >= PREALLOCATE_MIN_SIZE))))) {
+		if (mismatch && !isnewfile) { // truncate file if real-size != excepted file size
+			LOG_ERROR("File %s already exists but file-size missmatched",
+				  filename.c_str());
+		}
+		if (!Allocate(handle, size)) {
+			LOG_ERROR("Couldn't allocate %ld bytes for %s: %s", size,
+				  filename.c_str(), strerror(errno));
+			close(handle);
+			handle = -1;
+			if (isnewfile) {
+				fileSystem->removeFile(tmpfile);
+			}
 			return false;
 		}
-		LOG_ERROR("File %s already exists but file-size missmatched",
-			  filename.c_str());
-	} else if (size <= 0) {
-		// TODO: allocate disk space
 	}
 	LOG_DEBUG("opened %s", filename.c_str());
 	return true;
@@ -143,28 +427,67 @@ bool CFile::Hash(IHash& hash, int piece)
 	return true;
 }
 
+bool CFile::Hash(const std::string& path, long offset, long size, IHash& hash)
+{
+	const int fd = OpenFd(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	char buf[IO_BUF_SIZE];
+	hash.Init();
+	bool res = true;
+	while (size > 0) {
+		const int toread = std::min(size, (long)sizeof(buf));
+		if (!ReadFully(fd, buf, toread, offset)) {
+			res = false;
+			break;
+		}
+		hash.Update(buf, toread);
+		offset += toread;
+		size -= toread;
+	}
+	close(fd);
+	if (res) {
+		hash.Final();
+	}
+	return res;
+}
+
 int CFile::Read(char* buf, int bufsize, int piece)
 {
-	SetPos(GetPiecePos(piece), piece);
+	const long pos = GetPiecePos(piece);
 	//	LOG("Read(%d) bufsize: %d GetPiecePos(): %d GetPieceSize() %d",piece,
 	// bufsize, GetPiecePos(piece), GetPieceSize(piece));
-	clearerr(handle);
-	int items = fread(buf, bufsize, 1, handle);
-	if (items <= 0) {
-		if (ferror(handle)) {
-			LOG_DEBUG("read error %s bufsize: %d curpos: %d GetPieceSize: %d",
-				  strerror(errno), bufsize, curpos, GetPieceSize());
-			SetPos(0, piece);
-			return -1;
-		}
-		if (feof(handle)) {
-			LOG_DEBUG("EOF while Read: '%s' items: %d!", strerror(errno), items);
-			LOG_DEBUG("read error %s bufsize: %d curpos: %d GetPieceSize: %d",
-				  strerror(errno), bufsize, curpos, GetPieceSize());
+	if (PRead(buf, bufsize, GetPieceStart(piece) + pos) != bufsize) {
+		LOG_DEBUG("read error %s bufsize: %d pos: %d GetPieceSize: %d",
+			  strerror(errno), bufsize, pos, GetPieceSize());
+		return -1;
+	}
+	SetPos(pos + bufsize, piece); // inc pos
+	return bufsize;
+}
+
+int CFile::PRead(char* buf, int bufsize, long offset)
+{
+	if (!Flush() || !ReadFully(handle, buf, bufsize, offset)) {
+		return -1;
+	}
+	return bufsize;
+}
+
+int CFile::PWrite(const char* buf, int bufsize, long offset)
+{
+	int done = 0;
+	while (done < bufsize) {
+		const long res = IoRing::WriteAt(handle, buf + done, bufsize - done, offset + done);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			LOG_ERROR("write error %s: %s", filename.c_str(), strerror(errno));
 			return -1;
 		}
+		done += res;
 	}
-	SetPos(GetPiecePos(piece) + bufsize, piece); // inc pos
 	return bufsize;
 }
 
@@ -181,56 +504,97 @@ void CFile::SetPos(long pos, int piece)
 		assert(size <= 0 || pos <= size);
 		curpos = pos;
 	}
-	Seek(pos, piece);
 }
 
 int CFile::Write(const char* buf, int bufsize, int piece)
 {
 	assert(bufsize > 0);
 
-	SetPos(GetPiecePos(piece), piece);
-	clearerr(handle);
-	//	LOG("Write() bufsize %d piece %d handle %d", bufsize, piece,
-	// fileno(handle));
-	static int const PIECES = 1;
-	const int res = fwrite(buf, bufsize, PIECES, handle);
-	if (res != PIECES)
-		LOG_ERROR("write error %s (%d):  %s", filename.c_str(), res,
-			  strerror(errno));
-	//	LOG("wrote bufsize %d", bufsize);
-	if (ferror(handle) != 0) {
-		LOG_ERROR("Error in write(): %s %s", strerror(errno), filename.c_str());
-		abort();
-	}
-	if (feof(handle)) {
-		LOG_ERROR("EOF in write(): %s %s", strerror(errno), filename.c_str());
-	}
-	SetPos(GetPiecePos(piece) + bufsize, piece);
-	/*	if ((piece>=0) && (GetPiecePos(piece)==GetPieceSize(piece))) {
-                  LOG("piece finished: %d", piece);
-          }
-  */
+	const long pos = GetPiecePos(piece);
+	//	LOG("Write() bufsize %d piece %d handle %d", bufsize, piece, handle);
+	if (!Buffer(buf, bufsize, GetPieceStart(piece) + pos)) {
+		return -1;
+	}
+	SetPos(pos + bufsize, piece);
 	return bufsize;
 }
 
-int CFile::Seek(unsigned long pos, int piece)
+bool CFile::Buffer(const char* buf, int bufsize, long offset)
 {
-	assert(piece < (int)pieces.size());
-	if (piece >= 0) { // adjust position relative to piece pos
-		pos = this->piecesize * piece + pos;
+	std::unique_lock<std::mutex> lock(mutex);
+	if (error != 0) { // the file is incomplete already
+		return false;
+	}
+	const long end = offset + bufsize;
+	Run* run = nullptr;
+	for (Run& r : runs) {
+		const long rend = r.offset + r.data.size();
+		if (rend == offset) {
+			run = &r;
+		} else if ((r.offset < end) && (offset < rend)) {
+			// the range is written again, older data must not overwrite it
+			WriteRuns(lock);
+			run = nullptr;
+			break;
+		}
+	}
+	if (run == nullptr) {
+		runs.push_back(Run{offset, std::string()});
+		run = &runs.back();
+	}
+	run->data.append(buf, bufsize);
+	buffered += bufsize;
+
+	const bool pieceEnd = (piecesize > 0) && ((end % piecesize == 0) || (end == size));
+	if (pieceEnd) {
+		Submit(*run, run->data.size());
+	} else if (run->data.size() >= WRITE_BLOCK) {
+		const long aligned = end - end % WRITE_ALIGN;
+		if (aligned > run->offset) {
+			Submit(*run, aligned - run->offset);
+		}
 	}
-	//	LOG("Seek() pos: %d piece: %d", pos, piece);
-	clearerr(handle);
-	if (fseek(handle, pos, SEEK_SET) != 0) {
-		LOG_ERROR("seek error %ld", pos);
+	if (run->data.empty()) {
+		runs.erase(runs.begin() + (run - runs.data()));
 	}
-	return pos;
+	if (buffered > MAX_BUFFERED) {
+		// writers which don't pause wait for the disk
+		WriteRuns(lock);
+	}
+	return error == 0;
+}
+
+void CFile::Submit(Run& run, size_t len)
+{
+	WriteBehind::Block* block = new WriteBehind::Block();
+	block->file = this;
+	block->offset = run.offset;
+	block->data = run.data.substr(0, len);
+	run.data.erase(0, len);
+	run.offset += len;
+	queued++;
+	queuedBytes += len;
+	WriteBehind::GetInstance().Submit(block);
+}
+
+bool CFile::WriteRuns(std::unique_lock<std::mutex>& lock)
+{
+	// blocks of the same range have to be written first
+	written.wait(lock, [this] { return queued == 0; });
+	for (const Run& run : runs) {
+		const int len = run.data.size();
+		if ((error == 0) && (PWrite(run.data.data(), len, run.offset) != len)) {
+			error = (errno != 0) ? errno : EIO;
+		}
+		buffered -= len;
+	}
+	runs.clear();
+	return error == 0;
 }
 
 bool CFile::SetPieceSize(int pieceSize)
 {
-	assert(handle ==
-	       nullptr); // this function has to be called before the file is opened
+	assert(handle < 0); // this function has to be called before the file is opened
 	pieces.clear();
 	if ((size <= 0) || (pieceSize <= 0)) {
 		LOG_DEBUG("SetPieceSize(): FileSize:%ld PieceSize: %d", size, pieceSize);
@@ -294,15 +658,74 @@ long CFile::GetPiecePos(int piece) const
 	return curpos;
 }
 
+void CFile::SetPiecePos(int piece, long pos)
+{
+	SetPos(pos, piece);
+}
+
+long CFile::GetPieceStart(int piece) const
+{
+	if (piece < 0)
+		return 0;
+	return (long)piecesize * piece;
+}
+
+bool CFile::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!runs.empty() || (queued > 0)) {
+		WriteRuns(lock);
+	}
+	return error == 0;
+}
+
+bool CFile::HasError()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return error != 0;
+}
+
+bool CFile::IsBufferFull()
+{
+	return queuedBytes >= MAX_QUEUED;
+}
+
+bool CFile::Sync()
+{
+	if (handle < 0) {
+		return false;
+	}
+	if (!Flush()) {
+		return false;
+	}
+#ifdef _WIN32
+	return _commit(handle) == 0;
+#else
+	return fsync(handle) == 0;
+#endif
+}
+
+std::string CFile::GetTmpPath(const std::string& filename)
+{
+	return filename + ".tmp";
+}
+
+const std::string& CFile::GetPath() const
+{
+	if (IsNewFile())
+		return tmpfile;
+	return filename;
+}
+
 long CFile::GetSizeFromHandle() const
 {
-	if (handle == nullptr) {
+	if (handle < 0) {
 		LOG_ERROR("GetSize(): file isn't opened!");
 		return -1;
 	}
 
 	struct stat sb;
-	if (fstat(fileno(handle), &sb) != 0) {
+	if (fstat(handle, &sb) != 0) {
 		LOG_ERROR("CFile::SetSize(): fstat failed");
 		return -1;
 	}
@@ -326,12 +749,12 @@ bool CFile::SetTimestamp(long timestamp)
 	FILETIME ftime;
 	HANDLE h;
 	bool close = false;
-	if (handle == nullptr) {
+	if (handle < 0) {
 		h = CreateFile(s2ws(filename).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
 			       OPEN_EXISTING, 0, nullptr);
 		close = true;
 	} else {
-		h = (HANDLE)_get_osfhandle(fileno(handle));
+		h = (HANDLE)_get_osfhandle(handle);
 	}
 	if (h == nullptr) {
 		return false;
@@ -345,10 +768,10 @@ bool CFile::SetTimestamp(long timestamp)
 #else
 	struct timeval tv = {0, 0};
 	tv.tv_sec = timestamp;
-	if (handle == nullptr) {
+	if (handle < 0) {
 		return lutimes(filename.c_str(), &tv) == 0;
 	} else {
-		return futimes(fileno(handle), &tv) == 0;
+		return futimes(handle, &tv) == 0;
 	}
 #endif
 }
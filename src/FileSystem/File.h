@@ -3,9 +3,11 @@
 #ifndef _FILE_H_
 #define _FILE_H_
 
+#include <condition_variable>
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
 
 #include <stdio.h>
 
@@ -45,24 +47,55 @@ public:
   */
 	bool Hash(IHash& hash, int piece = -1);
 	/**
+  *	hashes size bytes starting at offset of the file at path, the file is
+  *	opened with its own handle, so this can be called from any thread
+  */
+	static bool Hash(const std::string& path, long offset, long size, IHash& hash);
+	/**
   *	open file
+  *	@param resume continue writing the temporary file of a new file, if it exists
+  */
+	bool Open(const std::string& filename, long size = -1, int piecesize = -1,
+		  bool resume = false);
+	/**
+  *	close file, a new file is only moved to its destination when all data
+  *	was written
+  *	@return false if writing failed
   */
-	bool Open(const std::string& filename, long size = -1, int piecesize = -1);
+	bool Close();
 	/**
-  *	close file
+  *	closes files like Close(), their buffered data is written with one batch
+  *	of writes and they're closed with one batch of closes, i.e. through
+  *	io_uring
+  *	@return false if writing any of the files failed, see HasError()
   */
-	void Close();
+	static bool CloseAll(const std::vector<CFile*>& files);
 	/**
   *	read buf from file, starting at restored piece pos, if piece>=0
+  *	reads of different pieces may be done from different threads
   *   @todo hides IFile::Read
   */
 	int Read(char* buf, int bufsize, int piece = -1);
 	/**
   *	write buf to file, starting at last pos restored from piece, if piece>=0
+  *	writes of different pieces may be done from different threads. The data
+  *	is buffered, adjacent writes are written to disk together by a writer
+  *	thread, when a block is full or a piece is complete. After a write
+  *	failed (i.e. disk full), all writes fail
+  *	@return bufsize or -1 on error
   *   @todo hides IFile::Write
   */
 	int Write(const char* buf, int bufsize, int piece = -1);
 	/**
+  *	read / write bufsize bytes at the absolute offset, doesn't change any
+  *	read/write position, so it can be called from any thread. PWrite() is
+  *	unbuffered, Flush() has to be called before when the range was written
+  *	with Write()
+  *	@return bufsize or -1 on error
+  */
+	int PRead(char* buf, int bufsize, long offset);
+	int PWrite(const char* buf, int bufsize, long offset);
+	/**
   *	gets the size of the given pice, returns file size when piece<0. hint:
   *first piece=0
   *	@return the size of a peace
@@ -73,18 +106,67 @@ public:
   *	gets the read/write position of piece
   */
 	long GetPiecePos(int piece = -1) const;
+	/**
+  *	sets the read/write position of piece, relative to its start
+  */
+	void SetPiecePos(int piece, long pos);
+	/**
+  *	gets the absolute position of the start of piece
+  */
+	long GetPieceStart(int piece) const;
+	/**
+  *	writes buffered data, so it can be read by another handle
+  *	@return false if writing any data failed
+  */
+	bool Flush();
+	/**
+  *	@return true if writing any data failed, the file is incomplete
+  */
+	bool HasError();
+	/**
+  *	@return true when more data of all files waits for the writer thread
+  *	than allowed, writers which can pause should wait until it caught up
+  */
+	static bool IsBufferFull();
+	/**
+  *	writes buffered data to disk
+  */
+	bool Sync();
+	/**
+  *	gets the path of the file on disk, the temporary file while it is new
+  */
+	const std::string& GetPath() const;
 	bool IsNewFile() const;
+	/**
+  *	gets the path of the temporary file a new file is written to
+  */
+	static std::string GetTmpPath(const std::string& filename);
 
 	// FIXME: move to filesystem?!
 	long GetTimestamp() const;
 	bool SetTimestamp(long timestamp);
 
 private:
+	friend class WriteBehind;
+	struct Run { // buffered data of adjacent writes
+		long offset;
+		std::string data;
+	};
+	bool Buffer(const char* buf, int bufsize, long offset);
+	/**
+  * hands the first len bytes of run to the writer thread
+  */
+	void Submit(Run& run, size_t len);
+	/**
+  * waits for the writer thread, then writes all runs
+  * @return false if any write failed
+  */
+	bool WriteRuns(std::unique_lock<std::mutex>& lock);
 	/**
-  * seek to the (relative) position in the piece
-  * @return the (relative) position in the piece, -1 means absolute
+  * moves a new file to its destination after its handle was closed
+  * @param ok all data was written
   */
-	int Seek(unsigned long pos, int piece = -1);
+	bool Finish(bool ok);
 	/**
   * set the size of a pice
   * @return count of pieces
@@ -100,14 +182,19 @@ private:
 	long GetSizeFromHandle() const;
 	std::string filename;
 	std::string tmpfile;
-	FILE* handle = nullptr;			     // file handle
+	int handle = -1;			     // file descriptor
 	int piecesize = -1;			     // size of a piece
 	long size = -1;			     // file size
-	unsigned long curpos = 0;		     // current file pointer absolute position
+	unsigned long curpos = 0;		     // read/write position when piece<0
 	std::vector<CFilePiece> pieces;      // pieces of the file
 	std::map<std::string, IHash*> hashs; // checksums for the complete file
 	bool isnewfile = true;
 	long timestamp = 0;
+	std::vector<Run> runs;
+	unsigned int queued = 0; // blocks not written by the writer thread yet
+	int error = 0;		 // errno of the first failed write
+	std::mutex mutex;	 // runs + queued + error
+	std::condition_variable written;
 };
 
 #endif
@@ -14,6 +14,7 @@ public:
 	unsigned int size = 0;
 	unsigned int compsize = 0; // compressed size
 	bool download = false;
+	bool verified = false; // checked while it was downloaded
 	int mode = 0644; // chmod
 };
 
@@ -4,33 +4,57 @@
 #include "Util.h"
 #include "Downloader/IDownloader.h"
 #include "HashMD5.h"
+#include "HashGzipMD5.h"
 #include "HashSHA1.h"
 #include "FileData.h"
+#include "IoRing.h"
+#include "PoolIndex.h"
+#include "ValidationLedger.h"
 #include "Logger.h"
 #include "SevenZipArchive.h"
 #include "ZipArchive.h"
 
 #include <zlib.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <vector>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <shlobj.h>
 #include <math.h>
+#include <io.h>
+#include <process.h>
 #ifndef SHGFP_TYPE_CURRENT
 #define SHGFP_TYPE_CURRENT 0
 #endif
 #else
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/statvfs.h>
 #include <errno.h>
 #endif
 
+#define VALIDATE_BATCH 64 // pool files which are read at once
+#define VALIDATE_MAX_SIZE (512 * 1024) // larger files are read in chunks
+#define VALIDATE_MAX_THREADS 64 // validating is cpu bound, one thread per core
+#define VALIDATE_RESERVED_FDS 64 // file descriptors left for the rest of the process
+#define VALIDATE_OPEN_RETRIES 100 // waits of 10ms when no file descriptor is left
+
 static CFileSystem* singleton = nullptr;
 
 FILE* CFileSystem::propen(const std::string& filename,
@@ -52,6 +76,9 @@ bool CFileSystem::fileIsValid(const FileData* mod,
 {
 	unsigned char data[IO_BUF_SIZE];
 	FILE* f = propen(filename, "rb");
+	if (f == nullptr) {
+		return false;
+	}
 	gzFile inFile = gzdopen(fileno(f), "rb");
 	if (inFile == nullptr) { // file can't be opened
 		fclose(f);
@@ -83,6 +110,257 @@ bool CFileSystem::fileIsValid(const FileData* mod,
 	return true;
 }
 
+// checks the md5 of the inflated content of a .gz file read into memory
+static bool IsValidGz(const FileData* mod, const std::string& data)
+{
+	HashGzipMD5 md5hash;
+	md5hash.Init();
+	md5hash.Update(data.data(), data.size());
+	md5hash.Final();
+	return md5hash.compare(mod->md5, sizeof(mod->md5));
+}
+
+struct PoolFile {
+	std::string path;
+	std::string md5;
+	FileData filedata;
+	int fd = -1;
+	struct stat sb; // of the validated file, valid if fd >= 0
+	ValidationLedger::Stat stat; // when it was found
+	std::string data;
+	IoRing::Op* read = nullptr;
+	bool valid = false; // true before validation: unchanged since last time
+	int error = 0; // errno of open() / fstat(), the file wasn't validated
+};
+
+// @return count of files the process may have open
+static size_t MaxOpenFiles()
+{
+#ifdef _WIN32
+	return _getmaxstdio();
+#else
+	struct rlimit limit;
+	if ((getrlimit(RLIMIT_NOFILE, &limit) != 0) || (limit.rlim_cur == RLIM_INFINITY)) {
+		return 1024 * 1024;
+	}
+	return limit.rlim_cur;
+#endif
+}
+
+// reads, closes and validates the opened files of a batch: small files are
+// read with one batch of reads and closed with one batch of closes, then
+// inflated from memory
+static void ValidateOpenFiles(const CFileSystem* fs, IoRing& ring,
+			      PoolFile* files, size_t count)
+{
+	std::vector<IoRing::Op> reads;
+	reads.reserve(count);
+	for (PoolFile* file = files; file < files + count; file++) {
+		if ((file->fd < 0) || (file->sb.st_size > VALIDATE_MAX_SIZE)) {
+			continue; // large files are checked by fileIsValid
+		}
+		file->data.resize(file->sb.st_size);
+		IoRing::Op op;
+		op.code = IoRing::OP_READ;
+		op.fd = file->fd;
+		op.buf = &file->data[0];
+		op.len = file->data.size();
+		reads.push_back(op);
+		file->read = &reads.back();
+	}
+	ring.Run(reads);
+
+	std::vector<IoRing::Op> closes;
+	for (PoolFile* file = files; file < files + count; file++) {
+		if (file->fd < 0)
+			continue;
+		IoRing::Op op;
+		op.code = IoRing::OP_CLOSE;
+		op.fd = file->fd;
+		closes.push_back(op);
+	}
+	ring.Run(closes);
+
+	for (PoolFile* file = files; file < files + count; file++) {
+		const std::string& data = file->data;
+		const bool gz = (data.size() >= 2) && ((unsigned char)data[0] == 0x1f) &&
+				((unsigned char)data[1] == 0x8b);
+		if ((file->read != nullptr) && gz) {
+			file->valid = ((size_t)file->read->result == data.size()) &&
+				      IsValidGz(&file->filedata, data);
+		} else if ((file->fd >= 0) && !file->valid) {
+			file->valid = fs->fileIsValid(&file->filedata, file->path);
+		}
+		file->read = nullptr;
+		std::string().swap(file->data);
+	}
+}
+
+// @return false if the file couldn't be opened, errno is set
+static bool OpenPoolFile(PoolFile* file)
+{
+#ifdef _WIN32
+	file->fd = _wopen(s2ws(file->path).c_str(), O_RDONLY | O_BINARY);
+#else
+	file->fd = open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+	if (file->fd < 0) {
+		return false;
+	}
+	if (fstat(file->fd, &file->sb) != 0) {
+		const int error = errno;
+		close(file->fd);
+		file->fd = -1;
+		errno = error;
+		return false;
+	}
+	return true;
+}
+
+// validates a batch of pool files, at most maxopen of them are open at once.
+// Files which can't be opened aren't validated, they're neither added to the
+// ledger nor removed
+static void ValidatePoolFiles(const CFileSystem* fs, IoRing& ring,
+			      PoolFile* files, size_t count, size_t maxopen)
+{
+	size_t first = 0;
+	while (first < count) {
+		size_t end = first;
+		size_t opened = 0;
+		int retries = 0;
+		while ((end < count) && (opened < maxopen)) {
+			PoolFile* file = &files[end];
+			if (file->valid) {
+				end++;
+				continue;
+			}
+			if (OpenPoolFile(file)) {
+				opened++;
+				end++;
+				continue;
+			}
+			if ((errno == EMFILE) || (errno == ENFILE)) {
+				if (opened > 0) {
+					break; // retried when the open ones are closed
+				}
+				if (retries < VALIDATE_OPEN_RETRIES) { // held by other threads
+					retries++;
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					continue;
+				}
+			}
+			file->error = errno;
+			LOG_ERROR("Couldn't open %s: %s", file->path.c_str(), strerror(errno));
+			end++;
+		}
+		ValidateOpenFiles(fs, ring, &files[first], end - first);
+		first = end;
+	}
+}
+
+// work-stealing queues of tasks: each worker takes the tasks from the front of
+// its own queue, a worker whose queue is empty takes them from the back of
+// the others
+template <typename T>
+class StealingQueues
+{
+public:
+	explicit StealingQueues(size_t count)
+	    : queues(count)
+	{
+	}
+	void Push(size_t worker, const T& task)
+	{
+		pending++;
+		Queue& queue = queues[worker % queues.size()];
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(task);
+		}
+		queued++;
+		Wake(false);
+	}
+	// @return false if all queues are empty
+	bool Pop(size_t worker, T& task)
+	{
+		for (size_t i = 0; i < queues.size(); i++) {
+			Queue& queue = queues[(worker + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty())
+				continue;
+			if (i == 0) {
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+			} else {
+				task = queue.tasks.back();
+				queue.tasks.pop_back();
+			}
+			queued--;
+			return true;
+		}
+		return false;
+	}
+	// has to be called when a task returned by Pop() is finished
+	void Done()
+	{
+		if (--pending == 0) {
+			Wake(true);
+		}
+	}
+	// runs work(worker, task) on threads until all tasks, including the ones
+	// pushed by running tasks, are done
+	template <typename F>
+	void Run(F work)
+	{
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < queues.size(); i++) {
+			threads.emplace_back([this, i, &work]() {
+				T task;
+				while (true) {
+					if (Pop(i, task)) {
+						work(i, task);
+						Done();
+						continue;
+					}
+					// the last tasks are running, wait until they push
+					// new ones or are done
+					std::unique_lock<std::mutex> lock(idle);
+					wake.wait(lock, [this]() { return (pending == 0) || (queued > 0); });
+					if (pending == 0)
+						break;
+				}
+			});
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<T> tasks;
+	};
+	void Wake(bool all)
+	{
+		// waiting workers check queued / pending with idle locked, so they
+		// can't miss the change
+		{
+			std::lock_guard<std::mutex> lock(idle);
+		}
+		if (all) {
+			wake.notify_all();
+		} else {
+			wake.notify_one();
+		}
+	}
+	std::vector<Queue> queues;
+	std::atomic<size_t> pending{0}; // pushed and not done
+	std::atomic<size_t> queued{0}; // pushed and not popped
+	std::mutex idle;
+	std::condition_variable wake;
+};
+
 std::string getMD5fromFilename(const std::string& path)
 {
 	const size_t start = path.rfind(PATH_DELIMITER) + 1;
@@ -199,6 +477,8 @@ CFileSystem* CFileSystem::GetInstance()
 
 void CFileSystem::Shutdown()
 {
+	PoolIndex::Shutdown();
+	ValidationLedger::Shutdown();
 	delete singleton;
 	singleton = nullptr;
 }
@@ -283,30 +563,39 @@ std::string CFileSystem::getPoolFilename(const std::string& md5str) const
 	 + ".gz";
 }
 
-int CFileSystem::validatePool(const std::string& path, bool deletebroken)
+int CFileSystem::validatePool(const std::string& path, bool deletebroken, bool full)
 {
 	if (!directoryExists(path)) {
 		LOG_ERROR("Pool directory doesn't exist: %s", path.c_str());
 		return 0;
 	}
-	int res = 0;
-	std::list<std::string> dirs;
-	dirs.push_back(path);
-	const int maxdirs = 257; // FIXME: unknown dirs in pool will break bar
-	int finished = 0;
-	IHash* md5 = new HashMD5();
-	while (!dirs.empty()) {
-		const std::string dir = dirs.front();
-		dirs.pop_front();
+	const size_t threads = std::max(1U, std::min(std::thread::hardware_concurrency(),
+						      (unsigned)VALIDATE_MAX_THREADS));
+	// the files of all workers which are open at once stay below the limit
+	const size_t maxfiles = MaxOpenFiles();
+	const size_t usable = maxfiles - std::min(maxfiles / 2, (size_t)VALIDATE_RESERVED_FDS);
+	const size_t maxopen = std::max(std::min(usable / threads, (size_t)VALIDATE_BATCH), (size_t)1);
+
+	// list the files, the directories are read in parallel
+	std::vector<std::vector<PoolFile>> found(threads);
+	std::vector<std::vector<std::string>> invalid(threads);
+	StealingQueues<std::string> dirs(threads);
+	dirs.Push(0, path);
+	dirs.Run([&found, &invalid, &dirs, full](size_t worker, const std::string& dir) {
 		DIR* d = opendir(dir.c_str());
+		if (d == nullptr) {
+			invalid[worker].push_back(dir);
+			return;
+		}
+		HashMD5 md5hash;
+		IHash& md5 = md5hash;
 		dirent* dentry;
 		while ((dentry = readdir(d)) != nullptr) {
-			LOG_PROGRESS(finished, maxdirs);
-			const std::string absname = dir + PATH_DELIMITER + dentry->d_name;
 			// don't check hidden files / . / ..
 			if (dentry->d_name[0] == '.') {
 				continue;
 			}
+			const std::string absname = dir + PATH_DELIMITER + dentry->d_name;
 #ifndef _WIN32
 			if ((dentry->d_type & DT_DIR) != 0) { // directory
 #else
@@ -314,45 +603,128 @@ int CFileSystem::validatePool(const std::string& path, bool deletebroken)
 			stat(absname.c_str(), &sb);
 			if ((sb.st_mode & S_IFDIR) != 0) {
 #endif
-				dirs.push_back(absname);
+				dirs.Push(worker, absname);
 				continue;
 			}
 
 			const int len = absname.length();
 			if (len < 36) { // file length has at least to be
 					// <md5[0]><md5[1]>/<md5[2-30]>.gz
-				LOG_ERROR("Invalid file: %s", absname.c_str());
+				invalid[worker].push_back(absname);
 				continue;
 			}
 
 			std::string md5str;
-			 // get md5 from path + filename
+			// get md5 from path + filename
 			md5str.push_back(absname.at(len - 36));
 			md5str.push_back(absname.at(len - 35));
 			md5str.append(absname.substr(len - 33, 30));
-			md5->Set(md5str);
-			FileData filedata;
+			md5.Set(md5str);
+			found[worker].emplace_back();
+			PoolFile& file = found[worker].back();
+			file.path = absname;
+			file.md5 = md5str;
 			for (unsigned i = 0; i < 16; i++) {
-				filedata.md5[i] = md5->get(i);
+				file.filedata.md5[i] = md5.get(i);
 			}
-
-			if (!fileIsValid(&filedata, absname)) { // check if md5 in filename
-								// is the same as in
-								// filename
-				LOG_ERROR("Invalid File in pool: %s", absname.c_str());
-				if (deletebroken) {
-					removeFile(absname);
-				}
-			} else {
-				res++;
+			if (!full) {
+				ValidationLedger::GetStat(absname, file.stat);
 			}
 		}
-		finished++;
 		closedir(d);
+	});
+
+	// sorted, so the result doesn't depend on which thread found a file
+	std::vector<PoolFile> files;
+	for (std::vector<PoolFile>& list : found) {
+		for (PoolFile& file : list) {
+			files.push_back(std::move(file));
+		}
+		std::vector<PoolFile>().swap(list);
+	}
+	std::sort(files.begin(), files.end(),
+		  [](const PoolFile& a, const PoolFile& b) { return a.path < b.path; });
+	std::vector<std::string> invalidnames;
+	for (const std::vector<std::string>& list : invalid) {
+		invalidnames.insert(invalidnames.end(), list.begin(), list.end());
+	}
+	std::sort(invalidnames.begin(), invalidnames.end());
+	for (const std::string& name : invalidnames) {
+		LOG_ERROR("Invalid file: %s", name.c_str());
+	}
+	// files which weren't changed since they were validated aren't read
+	int unchanged = 0;
+	for (PoolFile& file : files) {
+		if (!full && validationLedger->IsValidated(file.md5, file.stat)) {
+			file.valid = true;
+			unchanged++;
+		}
 	}
-	delete md5;
-	LOG_PROGRESS(finished, maxdirs, true);
+	LOG_INFO("Validating %d files in %s with %d threads, %d are unchanged",
+		 (int)files.size(), path.c_str(), (int)threads, unchanged);
+
+	// validate batches of files, the progress is reported by this thread only
+	StealingQueues<size_t> batches(threads);
+	for (size_t first = 0; first < files.size(); first += VALIDATE_BATCH) {
+		batches.Push(first / VALIDATE_BATCH, first);
+	}
+	std::atomic<size_t> validated{0};
+	std::thread validator([this, &files, &batches, &validated, threads, maxopen]() {
+		std::vector<std::unique_ptr<IoRing>> rings(threads);
+		batches.Run([this, &files, &validated, &rings, maxopen](size_t worker, size_t first) {
+			if (!rings[worker]) {
+				rings[worker].reset(new IoRing(VALIDATE_BATCH));
+			}
+			const size_t count = std::min(files.size() - first, (size_t)VALIDATE_BATCH);
+			ValidatePoolFiles(this, *rings[worker], &files[first], count, maxopen);
+			validated += count;
+		});
+	});
+	while (validated < files.size()) {
+		LOG_PROGRESS(validated, files.size());
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	validator.join();
+	LOG_PROGRESS(files.size(), files.size(), true);
 	LOG("");
+
+	// broken files are removed after all are validated, in the order of
+	// their names. A file is only removed when it wasn't replaced meanwhile,
+	// i.e. by a download running beside
+	int res = 0;
+	int unreadable = 0;
+	for (const PoolFile& file : files) {
+		if (file.valid) {
+			if (file.fd >= 0) { // was read
+				validationLedger->Add(file.md5, ValidationLedger::FromStat(file.sb));
+			}
+			res++;
+			continue;
+		}
+		if (file.error != 0) { // logged already, it isn't known to be broken
+			unreadable++;
+			continue;
+		}
+		LOG_ERROR("Invalid File in pool: %s", file.path.c_str());
+		validationLedger->Remove(file.md5);
+		if (!deletebroken || (file.fd < 0)) {
+			continue;
+		}
+		struct stat sb;
+		if ((stat(file.path.c_str(), &sb) != 0) || (sb.st_dev != file.sb.st_dev) ||
+		    (sb.st_ino != file.sb.st_ino) || (sb.st_size != file.sb.st_size) ||
+		    (sb.st_mtime != file.sb.st_mtime)) {
+			LOG_WARN("%s changed while it was validated, not removed", file.path.c_str());
+			continue;
+		}
+		poolIndex->Prepare(file.md5);
+		if (removeFile(file.path)) {
+			poolIndex->Remove(file.md5);
+		}
+	}
+	if (unreadable > 0) {
+		LOG_ERROR("%d files couldn't be opened and weren't validated", unreadable);
+	}
 	return res;
 }
 
@@ -413,6 +785,18 @@ bool CFileSystem::removeFile(const std::string& path)
 	return res;
 }
 
+bool CFileSystem::syncFile(FILE* f)
+{
+	if (fflush(f) != 0) {
+		return false;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(f)) == 0;
+#else
+	return fsync(fileno(f)) == 0;
+#endif
+}
+
 bool CFileSystem::removeDir(const std::string& path)
 {
 #ifdef _WIN32
@@ -441,7 +825,7 @@ bool CFileSystem::dumpSDP(const std::string& filename)
 	return true;
 }
 
-bool CFileSystem::validateSDP(const std::string& sdpPath)
+bool CFileSystem::validateSDP(const std::string& sdpPath, bool full, bool quick)
 {
 	LOG_DEBUG("CFileSystem::validateSDP() ...");
 	if (!fileExists(sdpPath)){
@@ -459,24 +843,164 @@ bool CFileSystem::validateSDP(const std::string& sdpPath)
 		return false;
 	}
 
+	return quick ? quickCheckFiles(files) : validateFiles(files, full);
+}
+
+bool CFileSystem::validateFiles(const std::list<FileData>& files, bool full)
+{
 	bool valid = true;
-	for (FileData& fd : files) {
+	for (const FileData& fd : files) {
+		if (fd.verified) {
+			continue;
+		}
 		HashMD5 fileMd5;
 		fileMd5.Set(fd.md5, sizeof(fd.md5));
-		const std::string filePath = getPoolFilename(fileMd5.toString());
-		if(!fileExists(filePath)) {
+		const std::string md5str = fileMd5.toString();
+		const std::string filePath = getPoolFilename(md5str);
+		ValidationLedger::Stat stat;
+		if (!ValidationLedger::GetStat(filePath, stat)) {
 			valid = false;
 			LOG_INFO("Missing file: %s", filePath.c_str());
+			poolIndex->Remove(md5str);
+		} else if (!full && validationLedger->IsValidated(md5str, stat)) {
+			continue;
 		} else if (!fileIsValid(&fd, filePath)) {
 			valid = false;
 			LOG_INFO("Removing invalid file: %s", filePath.c_str());
+			validationLedger->Remove(md5str);
+			poolIndex->Prepare(md5str);
 			if (!removeFile(filePath)) {
 				LOG_ERROR("Failed removing %s, aborting", filePath.c_str());
 				return false;
 			}
+			poolIndex->Remove(md5str);
+		} else {
+			validationLedger->Add(md5str, stat);
 		}
 	}
-	LOG_DEBUG("CFileSystem::validateSDP() done");
+	LOG_DEBUG("CFileSystem::validateFiles() done");
+	return valid;
+}
+
+struct QuickFile {
+	const FileData* filedata = nullptr;
+	std::string path;
+	std::string md5;
+	int fd = -1;
+	unsigned char trailer[8] = {};
+	IoRing::Op* read = nullptr;
+};
+
+// the byte order of crc32 / size in sdp files differs between the tools which
+// wrote them, both are accepted
+static bool MatchesTrailer(const FileData& fd, const unsigned char trailer[8])
+{
+	unsigned char crc32[4];
+	memcpy(crc32, fd.crc32, sizeof(crc32));
+	const unsigned int crcbe = parse_int32(crc32);
+	const unsigned int crcle = crc32[0] | crc32[1] << 8 | crc32[2] << 16 | (unsigned int)crc32[3] << 24;
+	const unsigned int sizebe = fd.size;
+	const unsigned int sizele = (sizebe >> 24) | ((sizebe >> 8) & 0xff00) |
+				    ((sizebe << 8) & 0xff0000) | (sizebe << 24);
+	const unsigned int crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (unsigned int)trailer[3] << 24;
+	const unsigned int isize = trailer[4] | trailer[5] << 8 | trailer[6] << 16 | (unsigned int)trailer[7] << 24;
+	return ((crc == crcle) || (crc == crcbe)) && ((isize == sizele) || (isize == sizebe));
+}
+
+// reads the trailers of a batch of pool files with one batch of reads
+static bool QuickCheckPoolFiles(CFileSystem* fs, IoRing& ring, std::vector<QuickFile>& files)
+{
+	std::vector<IoRing::Op> reads;
+	reads.reserve(files.size());
+	for (QuickFile& file : files) {
+#ifdef _WIN32
+		file.fd = _wopen(s2ws(file.path).c_str(), O_RDONLY | O_BINARY);
+#else
+		file.fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+		struct stat sb;
+		if (file.fd < 0) {
+			continue;
+		}
+		if (fstat(file.fd, &sb) != 0) { // not removed as invalid without the size
+			LOG_ERROR("Couldn't stat %s: %s", file.path.c_str(), strerror(errno));
+			close(file.fd);
+			file.fd = -1;
+			continue;
+		}
+		if (sb.st_size < 18) {
+			continue; // a .gz has a 10 byte header and a 8 byte trailer at least
+		}
+		IoRing::Op op;
+		op.code = IoRing::OP_READ;
+		op.fd = file.fd;
+		op.buf = (char*)file.trailer;
+		op.len = sizeof(file.trailer);
+		op.offset = sb.st_size - sizeof(file.trailer);
+		reads.push_back(op);
+		file.read = &reads.back();
+	}
+	ring.Run(reads);
+
+	std::vector<IoRing::Op> closes;
+	for (QuickFile& file : files) {
+		if (file.fd < 0)
+			continue;
+		IoRing::Op op;
+		op.code = IoRing::OP_CLOSE;
+		op.fd = file.fd;
+		closes.push_back(op);
+	}
+	ring.Run(closes);
+
+	bool valid = true;
+	for (QuickFile& file : files) {
+		if (file.fd < 0) {
+			valid = false;
+			LOG_INFO("Missing file: %s", file.path.c_str());
+			poolIndex->Remove(file.md5);
+			continue;
+		}
+		if ((file.read != nullptr) && (file.read->result == sizeof(file.trailer)) &&
+		    MatchesTrailer(*file.filedata, file.trailer)) {
+			continue;
+		}
+		valid = false;
+		LOG_INFO("Removing invalid file: %s", file.path.c_str());
+		validationLedger->Remove(file.md5);
+		poolIndex->Prepare(file.md5);
+		if (!fs->removeFile(file.path)) {
+			LOG_ERROR("Failed removing %s", file.path.c_str());
+		}
+		poolIndex->Remove(file.md5);
+	}
+	files.clear();
+	return valid;
+}
+
+bool CFileSystem::quickCheckFiles(const std::list<FileData>& files)
+{
+	IoRing ring(VALIDATE_BATCH);
+	std::vector<QuickFile> batch;
+	batch.reserve(VALIDATE_BATCH);
+	bool valid = true;
+	for (const FileData& fd : files) {
+		if (fd.verified) {
+			continue;
+		}
+		HashMD5 fileMd5;
+		fileMd5.Set(fd.md5, sizeof(fd.md5));
+		batch.emplace_back();
+		QuickFile& file = batch.back();
+		file.filedata = &fd;
+		file.md5 = fileMd5.toString();
+		file.path = getPoolFilename(file.md5);
+		if (batch.size() >= VALIDATE_BATCH) {
+			valid &= QuickCheckPoolFiles(this, ring, batch);
+		}
+	}
+	valid &= QuickCheckPoolFiles(this, ring, batch);
+	LOG_DEBUG("CFileSystem::quickCheckFiles() done");
 	return valid;
 }
 
@@ -595,6 +1119,87 @@ bool CFileSystem::Rename(const std::string& source,
 #endif
 }
 
+bool CFileSystem::WriteFileAtomic(const std::string& path, const std::string& content, bool sync)
+{
+	// unique for each process and call, writers don't truncate each others file
+	static std::atomic<unsigned int> count{0};
+#ifdef _WIN32
+	const int pid = _getpid();
+#else
+	const int pid = getpid();
+#endif
+	const std::string tmp = path + "." + std::to_string(pid) + "." + std::to_string(count++) + ".tmp";
+	FILE* f = propen(tmp, "w");
+	if (f == nullptr) {
+		return false;
+	}
+	fwrite(content.data(), 1, content.size(), f);
+	const bool ok = (ferror(f) == 0) && (!sync || syncFile(f));
+	if ((fclose(f) != 0) || !ok) {
+		LOG_ERROR("Error writing %s", tmp.c_str());
+		removeFile(tmp);
+		return false;
+	}
+#ifdef _WIN32
+	removeFile(path); // MoveFile doesn't replace existing files
+#endif
+	return Rename(tmp, path);
+}
+
+CFileLock::CFileLock(const std::string& path)
+{
+	const std::string lockfile = path + ".lock";
+#ifdef _WIN32
+	handle = CreateFileW(s2ws(lockfile).c_str(), GENERIC_READ | GENERIC_WRITE,
+			     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+			     OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	OVERLAPPED overlapped = {};
+	if ((handle != INVALID_HANDLE_VALUE) &&
+	    !LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+		CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
+	}
+#else
+	fd = open(lockfile.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	int res = -1;
+	while ((fd >= 0) && ((res = flock(fd, LOCK_EX)) != 0) && (errno == EINTR)) {
+	}
+	if ((fd >= 0) && (res != 0)) {
+		close(fd);
+		fd = -1;
+	}
+#endif
+	if (!IsLocked()) {
+		LOG_WARN("Couldn't lock %s", lockfile.c_str());
+	}
+}
+
+CFileLock::~CFileLock()
+{
+	// the lock file is kept, removing it would race with processes waiting
+	// for the lock
+#ifdef _WIN32
+	if (handle != INVALID_HANDLE_VALUE) {
+		OVERLAPPED overlapped = {};
+		UnlockFileEx(handle, 0, 1, 0, &overlapped);
+		CloseHandle(handle);
+	}
+#else
+	if (fd >= 0) {
+		close(fd); // releases the lock
+	}
+#endif
+}
+
+bool CFileLock::IsLocked() const
+{
+#ifdef _WIN32
+	return handle != INVALID_HANDLE_VALUE;
+#else
+	return fd >= 0;
+#endif
+}
+
 std::string CFileSystem::DirName(const std::string& path)
 {
 	const std::string::size_type pos = path.rfind(PATH_DELIMITER);
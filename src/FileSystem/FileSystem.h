@@ -52,9 +52,11 @@ public:
 
 	/**
           Validate all files in /pool/ (check md5)
+          @param full validate files which are unchanged since they were
+     validated last time, too
           @return count of valid files found
   */
-	int validatePool(const std::string& path, bool deletebroken);
+	int validatePool(const std::string& path, bool deletebroken, bool full = false);
 
 	/**
           check if file is older then secs, returns true if file is older or
@@ -85,8 +87,21 @@ public:
 	bool dumpSDP(const std::string& filename);
 	/**
   *	validates the given .sdp
+  *	@param quick only check the trailers, see quickCheckFiles()
   */
-	bool validateSDP(const std::string& filename);
+	bool validateSDP(const std::string& filename, bool full = false, bool quick = false);
+	/**
+  *	validates the pool files of an .sdp, files which were verified while
+  *	they were received or unchanged since they were validated (unless full)
+  *	are skipped. Invalid files are removed
+  */
+	bool validateFiles(const std::list<FileData>& files, bool full = false);
+	/**
+  *	checks crc32 and size of the pool files of an .sdp with the trailer of
+  *	the .gz (CRC32 + ISIZE), only the last 8 bytes of each file are read.
+  *	Catches truncated and damaged files, but not all
+  */
+	bool quickCheckFiles(const std::list<FileData>& files);
 	/**
   *	extracts a 7z file to dstdir
   */
@@ -112,6 +127,13 @@ public:
   */
 	bool Rename(const std::string& source, const std::string& destination);
 
+	/**
+	 * replaces path with content: writes a temporary file with a unique name
+	 * first, so other processes never read a partially written file
+	 * @param sync write the content to disk before replacing path
+	 */
+	bool WriteFileAtomic(const std::string& path, const std::string& content, bool sync = false);
+
 	/*
           replaces all invalid chars, i.e. \ from filename
   */
@@ -125,6 +147,10 @@ public:
 #endif
 
 	static bool removeFile(const std::string& path);
+	/**
+	 * writes the buffered data of f to disk
+	 */
+	static bool syncFile(FILE* f);
 	static bool removeDir(const std::string& path);
 
 	/*
@@ -143,6 +169,27 @@ private:
 	std::string springdir;
 };
 
+/**
+ * advisory lock of path + ".lock", held while the object exists. Serializes
+ * read-modify-write of files which are shared by processes
+ */
+class CFileLock
+{
+public:
+	explicit CFileLock(const std::string& path);
+	~CFileLock();
+	bool IsLocked() const;
+
+private:
+	CFileLock(const CFileLock&) = delete;
+	CFileLock& operator=(const CFileLock&) = delete;
+#ifdef _WIN32
+	void* handle;
+#else
+	int fd;
+#endif
+};
+
 #define fileSystem CFileSystem::GetInstance()
 
 #ifdef _WIN32
@@ -0,0 +1,59 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "HashGzipMD5.h"
+#include "FileSystem.h"
+
+#include <string.h>
+
+HashGzipMD5::HashGzipMD5()
+{
+	memset(&zs, 0, sizeof(zs));
+	state = inflateInit2(&zs, 16 + MAX_WBITS); // gzip header
+}
+
+HashGzipMD5::~HashGzipMD5()
+{
+	inflateEnd(&zs);
+}
+
+void HashGzipMD5::Init()
+{
+	HashMD5::Init();
+	if (state != Z_STREAM_ERROR && state != Z_MEM_ERROR) {
+		state = inflateReset(&zs);
+	}
+}
+
+void HashGzipMD5::Update(const char* data, const int size)
+{
+	unsigned char out[IO_BUF_SIZE * 16];
+	zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(data));
+	zs.avail_in = size;
+	do {
+		if (state == Z_STREAM_END) {
+			if (zs.avail_in == 0)
+				break;
+			state = inflateReset(&zs); // concatenated gzip
+			continue;
+		}
+		zs.next_out = out;
+		zs.avail_out = sizeof(out);
+		state = inflate(&zs, Z_NO_FLUSH);
+		HashMD5::Update(reinterpret_cast<char*>(out), sizeof(out) - zs.avail_out);
+		if (state == Z_BUF_ERROR) { // needs more input
+			state = Z_OK;
+			break;
+		}
+	} while (((state == Z_OK) || (state == Z_STREAM_END)) && ((zs.avail_in > 0) || (zs.avail_out == 0)));
+}
+
+void HashGzipMD5::Final()
+{
+	HashMD5::Final();
+	isset = state == Z_STREAM_END;
+}
+
+bool HashGzipMD5::compare(const unsigned char* data, int size) const
+{
+	return isSet() && HashMD5::compare(data, size);
+}
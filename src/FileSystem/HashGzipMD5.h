@@ -0,0 +1,34 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef _HASH_GZIP_MD5_H
+#define _HASH_GZIP_MD5_H
+
+#include "HashMD5.h"
+
+#include <zlib.h>
+
+/**
+ * md5 of the inflated content of gzip data, the compressed data is passed to
+ * Update() as it is received. The hash is only set, when the data was a
+ * complete gzip stream
+ */
+class HashGzipMD5 : public HashMD5
+{
+public:
+	HashGzipMD5();
+	~HashGzipMD5();
+	void Init() override;
+	void Update(const char* data, const int size) override;
+	void Final() override;
+	/**
+	 * @return false, when the data wasn't valid gzip or the hash differs
+	 */
+	bool compare(const unsigned char* data, int size) const override;
+	using HashMD5::compare;
+
+private:
+	z_stream zs;
+	int state = Z_OK; // of inflate()
+};
+
+#endif
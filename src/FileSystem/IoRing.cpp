@@ -0,0 +1,281 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "IoRing.h"
+#include "Logger.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+
+#define NOT_SUBMITTED LONG_MIN // result of ops the kernel didn't get, they're run without the ring
+
+IoRing::IoRing(unsigned int count)
+{
+#ifdef __linux__
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ringfd = syscall(__NR_io_uring_setup, count, &p);
+	if (ringfd < 0) {
+		LOG_DEBUG("io_uring isn't available: %s", strerror(errno));
+		return;
+	}
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) {
+		sqsize = cqsize = std::max(sqsize, cqsize);
+	}
+	sqesize = p.sq_entries * sizeof(io_uring_sqe);
+	sqmap = mmap(nullptr, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+	cqmap = single ? sqmap : mmap(nullptr, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+	sqemap = mmap(nullptr, sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+	if ((sqmap == MAP_FAILED) || (cqmap == MAP_FAILED) || (sqemap == MAP_FAILED)) {
+		LOG_WARN("Couldn't map io_uring: %s", strerror(errno));
+		if (sqmap == MAP_FAILED)
+			sqmap = nullptr;
+		if (cqmap == MAP_FAILED)
+			cqmap = nullptr;
+		if (sqemap == MAP_FAILED)
+			sqemap = nullptr;
+		Release();
+		return;
+	}
+	char* sq = static_cast<char*>(sqmap);
+	char* cq = static_cast<char*>(cqmap);
+	sqhead = reinterpret_cast<unsigned int*>(sq + p.sq_off.head);
+	sqtail = reinterpret_cast<unsigned int*>(sq + p.sq_off.tail);
+	sqmask = reinterpret_cast<unsigned int*>(sq + p.sq_off.ring_mask);
+	sqarray = reinterpret_cast<unsigned int*>(sq + p.sq_off.array);
+	cqhead = reinterpret_cast<unsigned int*>(cq + p.cq_off.head);
+	cqtail = reinterpret_cast<unsigned int*>(cq + p.cq_off.tail);
+	cqmask = reinterpret_cast<unsigned int*>(cq + p.cq_off.ring_mask);
+	cqes = cq + p.cq_off.cqes;
+	sqes = sqemap;
+	entries = p.sq_entries;
+#else
+	(void)count;
+#endif
+}
+
+IoRing::~IoRing()
+{
+	Release();
+}
+
+void IoRing::Release()
+{
+#ifdef __linux__
+	if (sqemap != nullptr)
+		munmap(sqemap, sqesize);
+	if ((cqmap != nullptr) && (cqmap != sqmap))
+		munmap(cqmap, cqsize);
+	if (sqmap != nullptr)
+		munmap(sqmap, sqsize);
+	if (ringfd >= 0)
+		close(ringfd);
+	sqmap = cqmap = sqemap = nullptr;
+	ringfd = -1;
+#endif
+}
+
+long IoRing::ReadAt(int fd, char* buf, size_t len, long offset)
+{
+#ifdef _WIN32
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+	DWORD done = 0;
+	if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, len, &done, &ov)) {
+		return (GetLastError() == ERROR_HANDLE_EOF) ? 0 : -1;
+	}
+	return done;
+#else
+	return pread(fd, buf, len, offset);
+#endif
+}
+
+long IoRing::WriteAt(int fd, const char* buf, size_t len, long offset)
+{
+#ifdef _WIN32
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+	DWORD done = 0;
+	if (!WriteFile((HANDLE)_get_osfhandle(fd), buf, len, &done, &ov)) {
+		return -1;
+	}
+	return done;
+#else
+	return pwrite(fd, buf, len, offset);
+#endif
+}
+
+void IoRing::RunSync(Op& op)
+{
+	switch (op.code) {
+		case OP_READ:
+		case OP_WRITE:
+			// continues after op.result bytes, i.e. of a short io_uring read
+			while ((op.result >= 0) && ((size_t)op.result < op.len)) {
+				const size_t done = op.result;
+				const long res = (op.code == OP_READ)
+					? ReadAt(op.fd, op.buf + done, op.len - done, op.offset + done)
+					: WriteAt(op.fd, op.buf + done, op.len - done, op.offset + done);
+				if (res < 0 && errno == EINTR)
+					continue;
+				if (res < 0) {
+					op.result = -errno;
+				} else if (res == 0) { // EOF
+					break;
+				} else {
+					op.result += res;
+				}
+			}
+			break;
+		case OP_FSYNC:
+#ifdef _WIN32
+			op.result = (_commit(op.fd) == 0) ? 0 : -errno;
+#else
+			op.result = (fsync(op.fd) == 0) ? 0 : -errno;
+#endif
+			break;
+		case OP_CLOSE:
+			op.result = (close(op.fd) == 0) ? 0 : -errno;
+			break;
+	}
+}
+
+bool IoRing::Submit(std::vector<Op>& ops, size_t first, size_t count)
+{
+#ifdef __linux__
+	io_uring_sqe* sqebuf = static_cast<io_uring_sqe*>(sqes);
+	unsigned int tail = *sqtail; // only written by this thread
+	const unsigned int mask = *sqmask;
+	for (size_t i = first; i < first + count; i++) {
+		Op& op = ops[i];
+		op.result = -ECANCELED; // the result is unknown until the completion is reaped
+		const unsigned int idx = tail & mask;
+		io_uring_sqe* sqe = &sqebuf[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		switch (op.code) {
+			case OP_READ:
+				sqe->opcode = IORING_OP_READ;
+				break;
+			case OP_WRITE:
+				sqe->opcode = IORING_OP_WRITE;
+				break;
+			case OP_FSYNC:
+				sqe->opcode = IORING_OP_FSYNC;
+				break;
+			case OP_CLOSE:
+				sqe->opcode = IORING_OP_CLOSE;
+				break;
+		}
+		sqe->fd = op.fd;
+		sqe->addr = (unsigned long)op.buf;
+		sqe->len = op.len;
+		sqe->off = op.offset;
+		sqe->user_data = i;
+		sqarray[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+
+	size_t unsubmitted = count;
+	size_t done = 0;
+	size_t expected = count; // completions to wait for
+	while (done < expected) {
+		const int res = syscall(__NR_io_uring_enter, ringfd, unsubmitted, expected - done,
+					IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (res < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+				continue;
+			if (unsubmitted > 0) {
+				// the kernel consumes the ring in order, the operations which
+				// weren't submitted are taken back and run without the ring
+				LOG_WARN("io_uring_enter failed: %s", strerror(errno));
+				tail -= (unsigned int)unsubmitted;
+				__atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+				expected -= unsubmitted;
+				for (size_t i = first + expected; i < first + count; i++) {
+					ops[i].result = NOT_SUBMITTED;
+				}
+				unsubmitted = 0;
+				if (expected == 0)
+					return false;
+				continue;
+			}
+			// completions can't be waited for: the ring isn't used anymore.
+			// Operations whose completion wasn't reaped keep -ECANCELED, they
+			// must not be run again (i.e. the fd of a close may be reused)
+			LOG_ERROR("io_uring_enter failed: %s", strerror(errno));
+			Release();
+			return true;
+		}
+		unsubmitted -= std::min((size_t)res, unsubmitted);
+
+		unsigned int head = *cqhead;
+		const unsigned int cqend = __atomic_load_n(cqtail, __ATOMIC_ACQUIRE);
+		while (head != cqend) {
+			const io_uring_cqe& cqe = static_cast<io_uring_cqe*>(cqes)[head & *cqmask];
+			ops[cqe.user_data].result = cqe.res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+	}
+	return true;
+#else
+	(void)ops;
+	(void)first;
+	(void)count;
+	return false;
+#endif
+}
+
+bool IoRing::Run(std::vector<Op>& ops)
+{
+	size_t first = 0;
+	for (; IsValid() && (first < ops.size()); first += entries) {
+		const size_t count = std::min(ops.size() - first, (size_t)entries);
+		const bool submitted = Submit(ops, first, count);
+		for (size_t i = first; i < first + count; i++) {
+			Op& op = ops[i];
+			if (!submitted || (op.result == NOT_SUBMITTED) || (op.result == -EINVAL) ||
+			    (op.result == -EOPNOTSUPP)) {
+				op.result = 0; // not supported by the kernel / not run by the ring
+				RunSync(op);
+			} else if ((op.result > 0) && ((size_t)op.result < op.len)) {
+				RunSync(op); // short read / write
+			}
+		}
+	}
+	for (; first < ops.size(); first++) { // without io_uring
+		ops[first].result = 0;
+		RunSync(ops[first]);
+	}
+	bool res = true;
+	for (const Op& op : ops) {
+		if (op.result < 0) {
+			res = false;
+		} else if (((op.code == OP_READ) || (op.code == OP_WRITE)) && ((size_t)op.result != op.len)) {
+			res = false;
+		}
+	}
+	return res;
+}
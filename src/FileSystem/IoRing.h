@@ -0,0 +1,82 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stddef.h>
+#include <vector>
+
+/**
+ * runs batches of file operations: with io_uring all operations of a batch
+ * are submitted and waited for with one syscall, if it isn't available (not
+ * linux, old kernel, disabled by seccomp) they are run one after another
+ * with pread/pwrite/fsync/close. Not thread safe, each thread needs its own
+ */
+class IoRing
+{
+public:
+	enum OpCode { OP_READ,
+		      OP_WRITE,
+		      OP_FSYNC,
+		      OP_CLOSE };
+	struct Op {
+		OpCode code = OP_READ;
+		int fd = -1;
+		char* buf = nullptr; // OP_READ / OP_WRITE
+		size_t len = 0;
+		long offset = 0;
+		long result = 0; // bytes read/written, < 0 on error (-errno)
+	};
+
+	/**
+	 * @param entries count of operations submitted at once
+	 */
+	explicit IoRing(unsigned int entries = 64);
+	~IoRing();
+	/**
+	 * @return true if io_uring is used
+	 */
+	bool IsValid() const
+	{
+		return ringfd >= 0;
+	}
+	/**
+	 * runs ops, which have to be independent of each other: they may be done
+	 * in any order. Short reads/writes are continued
+	 * @return true when all ops succeeded, reads have to fill buf completely
+	 */
+	bool Run(std::vector<Op>& ops);
+	/**
+	 * pread() / pwrite(), the offset is passed with each call so there is no
+	 * shared file position
+	 * @return count of bytes read/written, -1 on error
+	 */
+	static long ReadAt(int fd, char* buf, size_t len, long offset);
+	static long WriteAt(int fd, const char* buf, size_t len, long offset);
+
+private:
+	static void RunSync(Op& op);
+	void Release();
+	bool Submit(std::vector<Op>& ops, size_t first, size_t count);
+
+	int ringfd = -1;
+	void* sqmap = nullptr;
+	void* cqmap = nullptr;
+	void* sqemap = nullptr;
+	size_t sqsize = 0;
+	size_t cqsize = 0;
+	size_t sqesize = 0;
+	unsigned int entries = 0;
+	// pointers into the mapped rings
+	unsigned int* sqhead = nullptr;
+	unsigned int* sqtail = nullptr;
+	unsigned int* sqmask = nullptr;
+	unsigned int* sqarray = nullptr;
+	unsigned int* cqhead = nullptr;
+	unsigned int* cqtail = nullptr;
+	unsigned int* cqmask = nullptr;
+	void* cqes = nullptr;
+	void* sqes = nullptr;
+};
+
+#endif
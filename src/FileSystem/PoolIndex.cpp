@@ -0,0 +1,310 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "PoolIndex.h"
+#include "FileData.h"
+#include "FileSystem.h"
+#include "HashMD5.h"
+#include "Logger.h"
+#include "Util.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define INDEX_HEADER "# pr-downloader pool index v1"
+#define NAME_LENGTH 30 // md5 without the 2 chars of the directory
+
+static PoolIndex* singleton = nullptr;
+
+PoolIndex* PoolIndex::GetInstance()
+{
+	if (singleton == nullptr) {
+		const std::string root = fileSystem->getSpringDir() + PATH_DELIMITER;
+		singleton = new PoolIndex(root + "pool", root + "poolindex.txt");
+	}
+	return singleton;
+}
+
+void PoolIndex::Shutdown()
+{
+	if (singleton == nullptr)
+		return;
+	singleton->Save();
+	delete singleton;
+	singleton = nullptr;
+}
+
+PoolIndex::PoolIndex(const std::string& pool, const std::string& path)
+    : pool(pool)
+    , path(path)
+{
+}
+
+static bool GetMtime(const std::string& path, time_t& mtime)
+{
+#ifdef _WIN32
+	struct _stat sb;
+	const int res = _wstat(s2ws(path).c_str(), &sb);
+#else
+	struct stat sb;
+	const int res = stat(path.c_str(), &sb);
+#endif
+	if (res != 0) {
+		return false;
+	}
+	// changes within the same second can't be noticed, scan again next time
+	mtime = (sb.st_mtime >= time(nullptr)) ? 0 : sb.st_mtime;
+	return true;
+}
+
+// @return index of the directory of a hex md5, -1 if it's invalid
+static int GetDirIndex(const std::string& md5)
+{
+	if (md5.size() != NAME_LENGTH + 2) {
+		return -1;
+	}
+	char* end = nullptr;
+	const std::string prefix = md5.substr(0, 2);
+	const long dir = strtol(prefix.c_str(), &end, 16);
+	return (*end == '\0') ? dir : -1;
+}
+
+std::string PoolIndex::GetDir(int dir) const
+{
+	char buf[3];
+	snprintf(buf, sizeof(buf), "%02x", dir);
+	return pool + PATH_DELIMITER + buf;
+}
+
+void PoolIndex::Scan(int i)
+{
+	Dir& dir = dirs[i];
+	const std::string dirpath = GetDir(i);
+	dir.files.clear();
+	dir.changed = true;
+	dir.prepared = 0;
+	dir.stale = false;
+	dir.mtime = 0;
+	if (!GetMtime(dirpath, dir.mtime)) {
+		if (!CFileSystem::createSubdirs(dirpath + PATH_DELIMITER)) {
+			LOG_ERROR("Couldn't create %s", dirpath.c_str());
+		}
+		GetMtime(dirpath, dir.mtime);
+		return;
+	}
+	DIR* d = opendir(dirpath.c_str());
+	if (d == nullptr) {
+		dir.mtime = 0;
+		return;
+	}
+	dirent* dentry;
+	while ((dentry = readdir(d)) != nullptr) {
+		const size_t len = strlen(dentry->d_name);
+		if ((len == NAME_LENGTH + 3) && (strcmp(dentry->d_name + NAME_LENGTH, ".gz") == 0)) {
+			dir.files.insert(std::string(dentry->d_name, NAME_LENGTH));
+		}
+	}
+	closedir(d);
+}
+
+void PoolIndex::Update()
+{
+	if (updated)
+		return;
+	updated = true;
+	if (CFileSystem::fileExists(path)) {
+		Load();
+	}
+	int scanned = 0;
+	for (int i = 0; i < 256; i++) {
+		if (IsOutdated(i)) {
+			Scan(i);
+			scanned++;
+		}
+	}
+	LOG_DEBUG("Pool index: scanned %d directories", scanned);
+}
+
+// @return true if the directory changed since it was scanned / changed by us
+bool PoolIndex::IsOutdated(int i) const
+{
+	const Dir& dir = dirs[i];
+	time_t mtime;
+	return dir.stale || (dir.mtime == 0) || !GetMtime(GetDir(i), mtime) || (mtime != dir.mtime);
+}
+
+bool PoolIndex::Load()
+{
+	FILE* f = fileSystem->propen(path, "r");
+	if (f == nullptr) {
+		return false;
+	}
+	char line[256];
+	bool ok = (fgets(line, sizeof(line), f) != nullptr) &&
+		  (strncmp(line, INDEX_HEADER, strlen(INDEX_HEADER)) == 0);
+	while (ok && (fgets(line, sizeof(line), f) != nullptr)) {
+		int i;
+		long long mtime;
+		unsigned int count;
+		if ((sscanf(line, "%d %lld %u", &i, &mtime, &count) != 3) || (i < 0) || (i >= 256)) {
+			ok = false;
+			break;
+		}
+		Dir& dir = dirs[i];
+		dir.mtime = mtime;
+		dir.files.clear();
+		dir.files.reserve(count);
+		for (unsigned int n = 0; ok && (n < count); n++) {
+			ok = (fgets(line, sizeof(line), f) != nullptr) && (strlen(line) == NAME_LENGTH + 1);
+			if (ok) {
+				dir.files.insert(std::string(line, NAME_LENGTH));
+			}
+		}
+	}
+	fclose(f);
+	if (!ok) {
+		LOG_WARN("Invalid pool index %s, scanning the pool", path.c_str());
+		for (Dir& dir : dirs) {
+			dir.mtime = 0;
+		}
+	}
+	return ok;
+}
+
+bool PoolIndex::Save()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	bool changed = false;
+	for (int i = 0; i < 256; i++) {
+		Dir& dir = dirs[i];
+		if (!dir.changed)
+			continue;
+		changed = true;
+		dir.changed = false;
+		time_t mtime;
+		if (dir.stale || !GetMtime(GetDir(i), mtime) || (mtime != dir.mtime)) {
+			dir.mtime = 0; // scan again on the next load
+		}
+		dir.stale = false;
+	}
+	if (!changed) {
+		return true;
+	}
+
+	std::string content = INDEX_HEADER "\n";
+	for (int i = 0; i < 256; i++) {
+		const Dir& dir = dirs[i];
+		char line[64];
+		snprintf(line, sizeof(line), "%d %lld %u\n", i, (long long)dir.mtime,
+			 (unsigned int)dir.files.size());
+		content += line;
+		for (const std::string& name : dir.files) {
+			content += name + "\n";
+		}
+	}
+	return fileSystem->WriteFileAtomic(path, content);
+}
+
+bool PoolIndex::Contains(const std::string& md5)
+{
+	const int i = GetDirIndex(md5);
+	if (i < 0)
+		return false;
+	std::lock_guard<std::mutex> lock(mutex);
+	Update();
+	const std::unordered_set<std::string>& files = dirs[i].files;
+	return files.find(md5.substr(2)) != files.end();
+}
+
+void PoolIndex::Prepare(const std::string& md5)
+{
+	const int i = GetDirIndex(md5);
+	if (i < 0)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	Update();
+	Dir& dir = dirs[i];
+	time_t mtime;
+	// while changes of ours are in progress, the directory changes anyway
+	if ((dir.prepared == 0) && (!GetMtime(GetDir(i), mtime) || (mtime != dir.mtime))) {
+		dir.stale = true;
+	}
+	dir.prepared++;
+}
+
+void PoolIndex::Changed(int i)
+{
+	Dir& dir = dirs[i];
+	dir.changed = true;
+	// the mtime after our changes is only known if nobody else changed the
+	// directory before
+	if (dir.prepared == 0) {
+		dir.stale = true;
+		return;
+	}
+	dir.prepared--;
+	if ((dir.prepared == 0) && !GetMtime(GetDir(i), dir.mtime)) {
+		dir.stale = true;
+	}
+}
+
+void PoolIndex::Add(const std::string& md5)
+{
+	const int i = GetDirIndex(md5);
+	if (i < 0)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	Update();
+	dirs[i].files.insert(md5.substr(2));
+	Changed(i);
+}
+
+void PoolIndex::Remove(const std::string& md5)
+{
+	const int i = GetDirIndex(md5);
+	if (i < 0)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	Update();
+	dirs[i].files.erase(md5.substr(2));
+	Changed(i);
+}
+
+int PoolIndex::MarkMissing(std::list<FileData>& files)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Update();
+	int count = 0;
+	HashMD5 md5;
+	bool checked[256] = {};
+	for (FileData& fd : files) {
+		md5.Set(fd.md5, sizeof(fd.md5));
+		const std::string name = md5.toString();
+		const int i = GetDirIndex(name);
+		// the index may be older than this call, i.e. of a long running
+		// process. Directories with changes of ours in progress are current
+		if (!checked[i]) {
+			checked[i] = true;
+			if ((dirs[i].prepared == 0) && IsOutdated(i)) {
+				Scan(i);
+			}
+		}
+		const std::unordered_set<std::string>& existing = dirs[i].files;
+		fd.download = existing.find(name.substr(2)) == existing.end();
+		if (fd.download) {
+			count++;
+		}
+	}
+	return count;
+}
+
+void PoolIndex::Rescan()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (Dir& dir : dirs) {
+		dir.mtime = 0;
+	}
+	updated = false;
+}
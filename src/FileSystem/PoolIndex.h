@@ -0,0 +1,85 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef POOL_INDEX_H
+#define POOL_INDEX_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <time.h>
+#include <unordered_set>
+
+class FileData;
+
+/**
+ * knows which files exist in the rapid pool, so the files of a sdp which
+ * have to be downloaded are found without a stat() for each file. The names
+ * are kept for each of the 256 pool directories with the mtime of the
+ * directory and saved across runs. When the index is used the first time,
+ * directories which changed since (i.e. files were removed by hand) are
+ * scanned again, missing directories are created. Files written / removed by
+ * pr-downloader are added / removed directly, the new mtime of the directory
+ * is only kept when nobody else changed it in between
+ */
+class PoolIndex
+{
+public:
+	static PoolIndex* GetInstance();
+	static void Shutdown();
+
+	/**
+	 * @param pool directory of the pool
+	 * @param path file the index is saved to
+	 */
+	PoolIndex(const std::string& pool, const std::string& path);
+
+	/**
+	 * @param md5 hex md5 of the inflated file
+	 */
+	bool Contains(const std::string& md5);
+	/**
+	 * call before a file is written to / removed from the pool, so the
+	 * following Add() / Remove() can tell our change from the ones of others.
+	 * Several files of a directory may be prepared before they're added
+	 */
+	void Prepare(const std::string& md5);
+	void Add(const std::string& md5);
+	void Remove(const std::string& md5);
+	/**
+	 * sets FileData::download of all files, which aren't in the pool. The
+	 * directories of the files are scanned again if they changed, i.e. files
+	 * were removed by another process
+	 * @return count of missing files
+	 */
+	int MarkMissing(std::list<FileData>& files);
+	/**
+	 * scans all directories again
+	 */
+	void Rescan();
+	bool Save();
+
+private:
+	struct Dir {
+		time_t mtime = 0; // when it was scanned, 0 = scan again
+		bool changed = false; // by Add() / Remove()
+		unsigned int prepared = 0; // by Prepare(), changes of ours in progress
+		bool stale = false; // changed by others since it was scanned
+		std::unordered_set<std::string> files; // names without the .gz
+	};
+	void Update(); // lazily loads / scans the index
+	bool IsOutdated(int dir) const;
+	void Changed(int dir);
+	bool Load();
+	void Scan(int dir);
+	std::string GetDir(int dir) const;
+
+	std::string pool;
+	std::string path;
+	Dir dirs[256];
+	bool updated = false;
+	std::mutex mutex;
+};
+
+#define poolIndex PoolIndex::GetInstance()
+
+#endif
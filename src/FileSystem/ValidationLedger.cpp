@@ -0,0 +1,149 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#include "ValidationLedger.h"
+#include "FileSystem.h"
+#include "Logger.h"
+#include "Util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define LEDGER_HEADER "# pr-downloader validation ledger v1"
+#define MD5_LENGTH 32
+
+static ValidationLedger* singleton = nullptr;
+
+ValidationLedger* ValidationLedger::GetInstance()
+{
+	if (singleton == nullptr) {
+		singleton = new ValidationLedger(fileSystem->getSpringDir() + PATH_DELIMITER + "poolledger.txt");
+	}
+	return singleton;
+}
+
+void ValidationLedger::Shutdown()
+{
+	if (singleton == nullptr)
+		return;
+	singleton->Save();
+	delete singleton;
+	singleton = nullptr;
+}
+
+template <typename T>
+static ValidationLedger::Stat ToStat(const T& sb)
+{
+	ValidationLedger::Stat stat;
+	stat.dev = sb.st_dev;
+	stat.ino = sb.st_ino;
+	stat.size = sb.st_size;
+	stat.mtime = (unsigned long long)sb.st_mtime * 1000000000ULL;
+#if defined(__APPLE__)
+	stat.mtime += sb.st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+	stat.mtime += sb.st_mtim.tv_nsec;
+#endif
+	return stat;
+}
+
+ValidationLedger::Stat ValidationLedger::FromStat(const struct stat& sb)
+{
+	return ToStat(sb);
+}
+
+bool ValidationLedger::GetStat(const std::string& path, Stat& stat)
+{
+#ifdef _WIN32
+	struct _stat sb;
+	const int res = _wstat(s2ws(path).c_str(), &sb);
+#else
+	struct stat sb;
+	const int res = ::stat(path.c_str(), &sb);
+#endif
+	if (res != 0) {
+		return false;
+	}
+	stat = ToStat(sb);
+	return true;
+}
+
+ValidationLedger::ValidationLedger(const std::string& path)
+    : path(path)
+{
+}
+
+void ValidationLedger::Load()
+{
+	if (loaded)
+		return;
+	loaded = true;
+	if (!CFileSystem::fileExists(path)) {
+		return;
+	}
+	FILE* f = fileSystem->propen(path, "r");
+	if (f == nullptr) {
+		return;
+	}
+	char line[256];
+	bool ok = (fgets(line, sizeof(line), f) != nullptr) &&
+		  (strncmp(line, LEDGER_HEADER, strlen(LEDGER_HEADER)) == 0);
+	while (ok && (fgets(line, sizeof(line), f) != nullptr)) {
+		char md5[MD5_LENGTH + 1];
+		Stat stat;
+		ok = (sscanf(line, "%32s %llu %llu %llu %llu", md5, &stat.dev, &stat.ino, &stat.size, &stat.mtime) == 5) &&
+		     (strlen(md5) == MD5_LENGTH);
+		if (ok) {
+			files[md5] = stat;
+		}
+	}
+	fclose(f);
+	if (!ok) {
+		LOG_WARN("Invalid validation ledger %s, all files are validated", path.c_str());
+		files.clear();
+	}
+	LOG_DEBUG("Validation ledger: %d files", (int)files.size());
+}
+
+bool ValidationLedger::Save()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!changed) {
+		return true;
+	}
+	changed = false;
+
+	std::string content = LEDGER_HEADER "\n";
+	for (const auto& file : files) {
+		const Stat& stat = file.second;
+		char line[128];
+		snprintf(line, sizeof(line), " %llu %llu %llu %llu\n", stat.dev, stat.ino, stat.size, stat.mtime);
+		content += file.first + line;
+	}
+	return fileSystem->WriteFileAtomic(path, content);
+}
+
+bool ValidationLedger::IsValidated(const std::string& md5, const Stat& stat)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Load();
+	const auto it = files.find(md5);
+	return (it != files.end()) && (it->second == stat);
+}
+
+void ValidationLedger::Add(const std::string& md5, const Stat& stat)
+{
+	if (md5.size() != MD5_LENGTH)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	Load();
+	files[md5] = stat;
+	changed = true;
+}
+
+void ValidationLedger::Remove(const std::string& md5)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Load();
+	changed |= files.erase(md5) > 0;
+}
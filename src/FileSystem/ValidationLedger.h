@@ -0,0 +1,70 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+#ifndef VALIDATION_LEDGER_H
+#define VALIDATION_LEDGER_H
+
+#include <sys/stat.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * remembers which pool files were validated: for each md5 the device, inode,
+ * size and mtime (ns) of the file when it was hashed. A file with the same
+ * values wasn't changed since and doesn't have to be hashed again. Saved
+ * across runs
+ */
+class ValidationLedger
+{
+public:
+	struct Stat {
+		unsigned long long dev = 0;
+		unsigned long long ino = 0;
+		unsigned long long size = 0;
+		unsigned long long mtime = 0; // ns
+		bool operator==(const Stat& other) const
+		{
+			return (dev == other.dev) && (ino == other.ino) && (size == other.size) &&
+			       (mtime == other.mtime);
+		}
+	};
+
+	static ValidationLedger* GetInstance();
+	static void Shutdown();
+	/**
+	 * @return false if the file doesn't exist
+	 */
+	static bool GetStat(const std::string& path, Stat& stat);
+	/**
+	 * @param sb i.e. of fstat() on the file which was hashed
+	 */
+	static Stat FromStat(const struct stat& sb);
+
+	/**
+	 * @param path file the ledger is saved to
+	 */
+	explicit ValidationLedger(const std::string& path);
+
+	/**
+	 * @param md5 hex md5 of the inflated file
+	 * @return true if the file was validated with the same stat
+	 */
+	bool IsValidated(const std::string& md5, const Stat& stat);
+	void Add(const std::string& md5, const Stat& stat);
+	void Remove(const std::string& md5);
+	bool Save();
+
+private:
+	void Load();
+
+	std::string path;
+	std::unordered_map<std::string, Stat> files;
+	bool loaded = false;
+	bool changed = false;
+	std::mutex mutex;
+};
+
+#define validationLedger ValidationLedger::GetInstance()
+
+#endif
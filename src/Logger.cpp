@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
+#include <mutex>
 
 // Logging functions in standalone mode
 // prdLogRaw is supposed to flush after printing (mostly to stdout/err
@@ -91,10 +92,12 @@ extern void LOG_PROGRESS(long done, long total, bool forceOutput)
 {
 	static time_t lastlogtime = 0;
 	static float lastPercentage = 0.0f;
+	static std::mutex mutex; // rapid and http downloads run in parallel
 
 	if (!logEnabled) {
 		return;
 	}
+	std::lock_guard<std::mutex> lock(mutex);
 
 	const time_t now = time(nullptr);
 
@@ -19,6 +19,8 @@ enum {
 	RAPID_DOWNLOAD = 0,
 	RAPID_VALIDATE,
 	RAPID_VALIDATE_DELETE,
+	RAPID_VALIDATE_FULL,
+	RAPID_VALIDATE_QUICK,
 	RAPID_SEARCH,
 	HTTP_SEARCH,
 	HTTP_DOWNLOAD,
@@ -30,6 +32,7 @@ enum {
 	DOWNLOAD_GAME,
 	DOWNLOAD_ENGINE,
 	DISABLE_LOGGING,
+	MAX_SPEED,
 	HELP,
 	SHOW_VERSION,
 	EXTRACT_FILE,
@@ -40,6 +43,8 @@ static struct option long_options[] = {
     {"rapid-download", 1, 0, RAPID_DOWNLOAD},
     {"rapid-validate", 0, 0, RAPID_VALIDATE},
     {"delete", 0, 0, RAPID_VALIDATE_DELETE},
+    {"full", 0, 0, RAPID_VALIDATE_FULL},
+    {"quick", 0, 0, RAPID_VALIDATE_QUICK},
     {"dump-sdp", 1, 0, FILESYSTEM_DUMPSDP},
     {"validate-sdp", 1, 0, FILESYSTEM_VALIDATESDP},
     {"http-download", 1, 0, HTTP_DOWNLOAD},
@@ -49,6 +54,7 @@ static struct option long_options[] = {
     {"download-engine", 1, 0, DOWNLOAD_ENGINE},
     {"filesystem-writepath", 1, 0, FILESYSTEM_WRITEPATH},
     {"disable-logging", 0, 0, DISABLE_LOGGING},
+    {"max-speed", 1, 0, MAX_SPEED},
     {"help", 0, 0, HELP},
     {"version", 0, 0, SHOW_VERSION},
     {0, 0, 0, 0}};
@@ -122,6 +128,8 @@ int main(int argc, char** argv)
 		show_help(argv[0]);
 
 	bool removeinvalid = false;
+	bool validatefull = false; // validate unchanged files, too
+	bool validatequick = false; // only check the gzip trailers
 	bool fsset = false;
 
 	while (true) {
@@ -133,6 +141,14 @@ int main(int argc, char** argv)
 				removeinvalid = true;
 				break;
 			}
+			case RAPID_VALIDATE_FULL: {
+				validatefull = true;
+				break;
+			}
+			case RAPID_VALIDATE_QUICK: {
+				validatequick = true;
+				break;
+			}
 			case FILESYSTEM_WRITEPATH: {
 				fsset = true;
 				DownloadSetConfig(CONFIG_FILESYSTEM_WRITEPATH, optarg);
@@ -141,6 +157,11 @@ int main(int argc, char** argv)
 			case DISABLE_LOGGING:
 				DownloadDisableLogging(true);
 				break;
+			case MAX_SPEED: { // bytes/s
+				const int speed = atoi(optarg);
+				DownloadSetConfig(CONFIG_MAX_SPEED, &speed);
+				break;
+			}
 			default:
 				break;
 		}
@@ -165,7 +186,7 @@ int main(int argc, char** argv)
 				break;
 			}
 			case RAPID_VALIDATE: {
-				if (!DownloadRapidValidate(removeinvalid)) {
+				if (!DownloadRapidValidate(removeinvalid, validatefull)) {
 					LOG_ERROR("Validation of the rapid pool failed");
 					res = false;
 				}
@@ -179,7 +200,7 @@ int main(int argc, char** argv)
 				break;
 			}
 			case FILESYSTEM_VALIDATESDP: {
-				ValidateSDP(optarg);
+				ValidateSDP(optarg, validatefull, validatequick);
 				break;
 			}
 			case DOWNLOAD_MAP: {
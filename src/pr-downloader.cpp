@@ -1,6 +1,9 @@
 #include "pr-downloader.h"
 #include "Downloader/IDownloader.h"
+#include "Downloader/MirrorScore.h"
+#include "Downloader/RateLimit.h"
 #include "FileSystem/FileSystem.h"
+#include "FileSystem/File.h"
 #include "Logger.h"
 #include "lib/md5/md5.h"
 #include "lib/base64/base64.h"
@@ -9,6 +12,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <algorithm>
+#include <thread>
+
+#define EXTRACT_FACTOR 4 // margin: engines unpack to about this multiple of their archive
 
 static bool fetchDepends = true;
 
@@ -42,22 +49,12 @@ DownloadEnum::Category getPlatformEngineCat()
 	return DownloadEnum::CAT_ENGINE_LINUX64;
 }
 
-bool download_engine(std::list<IDownload*>& dllist)
+// extracts the downloaded engines
+bool extract_engines(const std::list<IDownload*>& dllist)
 {
 	bool res = true;
-	std::list<IDownload*> enginedls;
-
-	for (IDownload* dl : dllist) {
-		if (isEngineDownload(dl->cat)) {
-			enginedls.push_back(dl);
-		}
-	}
-	if (enginedls.empty())
-		return res;
-
-	httpDownload->download(enginedls);
-	for (const IDownload* dl : enginedls) {
-		if (!dl->isFinished())
+	for (const IDownload* dl : dllist) {
+		if (!isEngineDownload(dl->cat) || !dl->isFinished())
 			continue;
 		if (!fileSystem->extractEngine(dl->name, dl->version, LSL::Util::GetCurrentPlatformString())) {
 			LOG_ERROR("Failed to extract engine %s", dl->version.c_str());
@@ -67,6 +64,29 @@ bool download_engine(std::list<IDownload*>& dllist)
 	return res;
 }
 
+// @return bytes a download still needs on disk: files with known size are
+// preallocated, so an existing (i.e. journaled) file already holds its blocks.
+// Engines are extracted beside their archive
+static unsigned long long SpaceNeeded(const IDownload* dl)
+{
+	if (dl->size <= 0) {
+		return 0;
+	}
+	unsigned long long needed = dl->size;
+	const std::string tmpfile = CFile::GetTmpPath(dl->name);
+	long existing = 0;
+	if (CFileSystem::fileExists(dl->name)) {
+		existing = CFileSystem::getFileSize(dl->name);
+	} else if (CFileSystem::fileExists(tmpfile)) {
+		existing = CFileSystem::getFileSize(tmpfile);
+	}
+	needed -= std::min((unsigned long long)std::max(existing, 0L), needed);
+	if (isEngineDownload(dl->cat)) {
+		needed += EXTRACT_FACTOR * (unsigned long long)dl->size;
+	}
+	return needed;
+}
+
 // helper function
 IDownload* GetIDownloadByID(std::list<IDownload*>& dllist, int id)
 {
@@ -184,6 +204,17 @@ bool DownloadSetConfig(CONFIG type, const void* value)
 		case CONFIG_RAPID_FORCEUPDATE:
 			rapidDownload->setOption("forceupdate", ""); // FIXME, use value
 			return true;
+		case CONFIG_HTTP_ENGINE:
+			return httpDownload->setOption("engine", (const char*)value);
+		case CONFIG_MAX_SPEED:
+			rateLimit->SetLimit(RateLimit::BUDGET_TOTAL, *(const int*)value);
+			return true;
+		case CONFIG_MAX_HOST_SPEED:
+			rateLimit->SetLimit(RateLimit::BUDGET_HOST, *(const int*)value);
+			return true;
+		case CONFIG_MAX_DOWNLOAD_SPEED:
+			rateLimit->SetLimit(RateLimit::BUDGET_DOWNLOAD, *(const int*)value);
+			return true;
 	}
 	return false;
 }
@@ -200,6 +231,11 @@ bool DownloadGetConfig(CONFIG type, const void** value)
 		case CONFIG_RAPID_FORCEUPDATE:
 			// FIXME: implement
 			return false;
+		case CONFIG_HTTP_ENGINE:
+		case CONFIG_MAX_SPEED:
+		case CONFIG_MAX_HOST_SPEED:
+		case CONFIG_MAX_DOWNLOAD_SPEED:
+			return false;
 	}
 	return false;
 }
@@ -246,38 +282,63 @@ int DownloadStart()
 {
 	std::list<IDownload*> dls;
 	std::list<int>::iterator it;
-	const std::string dldir = fileSystem->getSpringDir();
-	const unsigned long MBsFree = CFileSystem::getMBsFree(dldir);
-	unsigned long dlsize = 0;
 	for (it = downloads.begin(); it != downloads.end(); ++it) {
 		IDownload* dl = GetIDownloadByID(searchres, *it);
-		if (dl->size > 0) {
-			dlsize += dl->size;
-		}
 		if (dl == nullptr) {
 			continue;
 		}
 		dls.push_back(dl);
 	}
-	// at least 1024MB free disk space are required (else fragmentation will make file access way to slow!)
-	const unsigned long MBsNeeded = (dlsize / (1024 * 1024)) + 1024;
+
+	if (fetchDepends) {
+		addDepends(dls);
+	}
+
+	const std::string dldir = fileSystem->getSpringDir();
+	const unsigned long MBsFree = CFileSystem::getMBsFree(dldir);
+	unsigned long long dlsize = 0;
+	for (const IDownload* dl : dls) {
+		dlsize += SpaceNeeded(dl);
+	}
+	const unsigned long MBsNeeded = (dlsize + 1024 * 1024 - 1) / (1024 * 1024);
 
 	if (MBsFree < MBsNeeded) {
 		LOG_ERROR("Insuffcient free disk space (%u MiB) on %s: %u MiB needed", MBsFree, dldir.c_str(), MBsNeeded);
 		return 5;
 	}
 
-	if (fetchDepends) {
-		addDepends(dls);
-	}
-
 	if (dls.empty()) {
 		LOG_DEBUG("Nothing to do, did you forget to call DownloadAdd()?");
 		return 1;
 	}
-	rapidDownload->download(dls);
-	httpDownload->download(dls, 1);
-	download_engine(dls);
+	std::list<IDownload*> rapiddls;
+	std::list<IDownload*> httpdls;
+	for (IDownload* dl : dls) {
+		if (dl->dltype == IDownload::TYP_RAPID) {
+			rapiddls.push_back(dl);
+		} else {
+			httpdls.push_back(dl);
+		}
+	}
+	// rapid downloads run in a thread beside the http downloads (maps and
+	// engines share the transfers of one loop), engines are extracted while
+	// the rapid downloads are still running. The bandwidth limits, the
+	// transfer windows and the mirror stats are shared, they're created
+	// before the thread starts (the windows by the downloaders)
+	IDownloader* rapid = rapidDownload;
+	MirrorScore::GetInstance();
+	RateLimit::GetInstance();
+	std::thread rapidThread;
+	if (!rapiddls.empty()) {
+		rapidThread = std::thread([rapid, &rapiddls]() { rapid->download(rapiddls); });
+	}
+	if (!httpdls.empty()) {
+		httpDownload->download(httpdls);
+		extract_engines(httpdls);
+	}
+	if (rapidThread.joinable()) {
+		rapidThread.join();
+	}
 	int res = 0;
 	for (const IDownload* dl: dls) {
 		if (dl->state != IDownload::STATE_FINISHED) {
@@ -288,10 +349,10 @@ int DownloadStart()
 	return res;
 }
 
-bool DownloadRapidValidate(bool deletebroken)
+bool DownloadRapidValidate(bool deletebroken, bool full)
 {
 	const std::string path = fileSystem->getSpringDir() + PATH_DELIMITER + "pool";
-	return fileSystem->validatePool(path, deletebroken);
+	return fileSystem->validatePool(path, deletebroken, full);
 }
 
 bool DownloadDumpSDP(const char* path)
@@ -299,9 +360,9 @@ bool DownloadDumpSDP(const char* path)
 	return fileSystem->dumpSDP(path);
 }
 
-bool ValidateSDP(const char* path)
+bool ValidateSDP(const char* path, bool full, bool quick)
 {
-	return fileSystem->validateSDP(path);
+	return fileSystem->validateSDP(path, full, quick);
 }
 
 void DownloadDisableLogging(bool disableLogging)
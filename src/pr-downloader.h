@@ -17,7 +17,8 @@ struct downloadInfo
 };
 /**
         downloads all downloads that where added with @DownloadAdd
-        clears search results
+        clears search results, rapid downloads run at the same time as http
+        downloads
 */
 extern int DownloadStart();
 
@@ -57,6 +58,10 @@ enum CONFIG {
 	CONFIG_FILESYSTEM_WRITEPATH = 1, // const char, sets the output directory
 	CONFIG_FETCH_DEPENDS,		 // bool, automaticly fetch depending files
 	CONFIG_RAPID_FORCEUPDATE,	// bool, always fetch repo files
+	CONFIG_HTTP_ENGINE,		 // const char, event loop for http: "select" or "epoll"
+	CONFIG_MAX_SPEED,		 // const int, bytes/s of all transfers, 0 = unlimited
+	CONFIG_MAX_HOST_SPEED,		 // const int, bytes/s from each host, 0 = unlimited
+	CONFIG_MAX_DOWNLOAD_SPEED,	 // const int, bytes/s of each download, 0 = unlimited
 };
 
 /**
@@ -72,8 +77,9 @@ extern bool DownloadGetConfig(CONFIG type, const void** value);
 /**
 * validate rapid pool
 * @param deletebroken files
+* @param full validate unchanged files, too
 */
-extern bool DownloadRapidValidate(bool deletebroken);
+extern bool DownloadRapidValidate(bool deletebroken, bool full = false);
 
 /**
 * dump contents of a sdp
@@ -82,14 +88,18 @@ extern bool DownloadDumpSDP(const char* path);
 
 /**
 * validate sdp files
+* @param full validate unchanged files, too
+* @param quick only compare crc32 and size with the trailers of the files
 */
-extern bool ValidateSDP(const char* path);
+extern bool ValidateSDP(const char* path, bool full = false, bool quick = false);
 
 /**
 * control printing to stdout
 */
 extern void DownloadDisableLogging(bool disableLogging);
 
+// called by rapid and http downloads, which may run at the same time in
+// different threads
 typedef void (*IDownloaderProcessUpdateListener)(int done, int size);
 
 extern void SetDownloadListener(IDownloaderProcessUpdateListener listener);
@@ -0,0 +1,92 @@
+/* This file is part of pr-downloader (GPL v2 or later), see the LICENSE file */
+
+/*
+	micro-benchmark for completion handling in CHttpDownloader: compares
+	looking up the DownloadData of a finished easy handle by scanning all
+	transfers with looking it up through CURLINFO_PRIVATE
+*/
+
+#include "Downloader/Http/DownloadData.h"
+
+#include <curl/curl.h>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+static DownloadData* LinearLookup(const std::vector<DownloadData*>& downloads,
+				  const std::vector<CURL*>& handles, const CURL* easy_handle)
+{
+	for (size_t i = 0; i < downloads.size(); i++) {
+		if (handles[i] == easy_handle) {
+			return downloads[i];
+		}
+	}
+	return nullptr;
+}
+
+static DownloadData* PrivateLookup(CURL* easy_handle)
+{
+	DownloadData* data = nullptr;
+	curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, (char**)&data);
+	return data;
+}
+
+int main(int argc, char** argv)
+{
+	const int count = (argc > 1) ? atoi(argv[1]) : 10000;
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	std::vector<DownloadData*> downloads;
+	std::vector<CURL*> handles;
+	Transfers transfers;
+	for (int i = 0; i < count; i++) {
+		DownloadData* data = new DownloadData();
+		CURL* handle = curl_easy_init();
+		curl_easy_setopt(handle, CURLOPT_PRIVATE, data);
+		downloads.push_back(data);
+		handles.push_back(handle);
+		transfers.SetActive(data);
+	}
+
+	// completions arrive in random order
+	std::vector<CURL*> completions = handles;
+	std::shuffle(completions.begin(), completions.end(), std::mt19937(42));
+
+	using Clock = std::chrono::steady_clock;
+	size_t found = 0;
+	const Clock::time_point linearStart = Clock::now();
+	for (CURL* handle : completions) {
+		found += LinearLookup(downloads, handles, handle) != nullptr;
+	}
+	const double linear = std::chrono::duration<double, std::milli>(Clock::now() - linearStart).count();
+
+	const Clock::time_point privateStart = Clock::now();
+	for (CURL* handle : completions) {
+		DownloadData* data = PrivateLookup(handle);
+		if (data != nullptr) {
+			transfers.SetIdle(data);
+			found++;
+		}
+	}
+	const double priv = std::chrono::duration<double, std::milli>(Clock::now() - privateStart).count();
+
+	printf("%d completions\n", count);
+	printf("linear scan:      %10.3f ms\n", linear);
+	printf("CURLINFO_PRIVATE: %10.3f ms\n", priv);
+
+	const bool ok = (found == completions.size() * 2) && transfers.active.empty() &&
+			(transfers.idle.size() == (size_t)count);
+	while (!transfers.idle.empty()) {
+		DownloadData* data = transfers.idle.front();
+		transfers.idle.remove(data);
+		delete data;
+	}
+	for (CURL* handle : handles) {
+		curl_easy_cleanup(handle);
+	}
+	curl_global_cleanup();
+	return ok ? 0 : 1;
+}
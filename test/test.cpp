@@ -2,6 +2,70 @@
 #include <boost/test/unit_test.hpp>
 
 #include "FileSystem/FileSystem.h"
+#include "FileSystem/File.h"
+#include "FileSystem/IoRing.h"
+#include "FileSystem/PoolIndex.h"
+#include "FileSystem/ValidationLedger.h"
+#include "FileSystem/FileData.h"
+#include "Downloader/Mirror.h"
+#include "Downloader/MirrorScore.h"
+#include "Downloader/Http/TransferLimit.h"
+#include "Downloader/Http/DownloadData.h"
+#include "Downloader/Http/Journal.h"
+#include "Downloader/Download.h"
+#include "Downloader/IDownloader.h"
+#include "Downloader/RateLimit.h"
+#include "FileSystem/HashMD5.h"
+#include "FileSystem/HashGzipMD5.h"
+#include "FileSystem/HashSHA1.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <utime.h>
+#endif
+#include <zlib.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static void RemoveTree(const std::string& path)
+{
+	DIR* d = opendir(path.c_str());
+	if (d == nullptr) {
+		CFileSystem::removeFile(path);
+		return;
+	}
+	dirent* dentry;
+	while ((dentry = readdir(d)) != nullptr) {
+		const std::string name = dentry->d_name;
+		if ((name != ".") && (name != "..")) {
+			RemoveTree(path + PATH_DELIMITER + name);
+		}
+	}
+	closedir(d);
+	CFileSystem::removeDir(path);
+}
+
+// the tests use their own spring dir, so the pool, pool index and validation
+// ledger of the user aren't touched
+struct WritePath {
+	const std::string path = "prd_test_springdir";
+	WritePath()
+	{
+		RemoveTree(path); // of a crashed run
+		CFileSystem::GetInstance()->setWritePath(path);
+	}
+	~WritePath()
+	{
+		CFileSystem::Shutdown(); // saves the index + ledger
+		RemoveTree(path);
+	}
+};
+BOOST_GLOBAL_FIXTURE(WritePath);
 
 BOOST_AUTO_TEST_CASE(prd)
 {
@@ -9,3 +73,765 @@ BOOST_AUTO_TEST_CASE(prd)
 	BOOST_CHECK("_____" == CFileSystem::EscapeFilename("/<|>\\"));
 	BOOST_CHECK("abC123" == CFileSystem::EscapeFilename("abC123"));
 }
+
+BOOST_AUTO_TEST_CASE(mirrorscore)
+{
+	BOOST_CHECK("example.com" == MirrorScore::GetHost("https://example.com/files/a.sd7"));
+	BOOST_CHECK("example.com:8080" == MirrorScore::GetHost("http://user:pw@example.com:8080/a"));
+	BOOST_CHECK("example.com" == MirrorScore::GetHost("example.com"));
+
+	MirrorScore score;
+	BOOST_CHECK(score.ExpectedTime("fast", 1000) < 0);
+	score.AddSample("fast", true, 1000, 0.1);
+	BOOST_CHECK_CLOSE(score.ExpectedTime("fast", 1000), 1.1, 0.001);
+	score.AddSample("fast", true, 2000, 0.1);
+	BOOST_CHECK_CLOSE(score.Get("fast").speed, 1300, 0.001);
+
+	// a mirror which was fast once, but is slow now
+	score.AddSample("congested", true, 100000, 0.1);
+	for (int i = 0; i < 20; i++) {
+		score.AddSample("congested", true, 100, 0.1);
+	}
+	BOOST_CHECK(score.ExpectedTime("fast", 100000) < score.ExpectedTime("congested", 100000));
+
+	// failed transfers make a mirror more expensive
+	score.AddSample("flaky", true, 1300, 0.1);
+	score.AddSample("flaky", false, 0, 0);
+	BOOST_CHECK_CLOSE(score.Get("flaky").errors, 0.3, 0.001);
+	BOOST_CHECK(score.ExpectedTime("fast", 1000) < score.ExpectedTime("flaky", 1000));
+
+	// a host which never worked is worse than any working one
+	score.AddSample("dead", false, 0, 0);
+	BOOST_CHECK(score.ExpectedTime("dead", -1) > score.ExpectedTime("congested", 100000));
+}
+
+BOOST_AUTO_TEST_CASE(mirrorscore_persist)
+{
+	const std::string path = "mirrorstats_test.txt";
+	CFileSystem::removeFile(path);
+
+	MirrorScore score;
+	score.AddSample("dead", false, 0, 0);
+	score.AddSample("dead", false, 0, 0);
+	score.AddSample("fast", true, 1000, 0.1);
+	BOOST_CHECK(score.Save(path));
+
+	MirrorScore other; // i.e. another process
+	other.AddSample("other", true, 500, 0.2);
+	BOOST_CHECK(other.Save(path)); // keeps the stats of score
+
+	MirrorScore loaded;
+	BOOST_CHECK(loaded.Load(path));
+	BOOST_CHECK_EQUAL(loaded.Get("dead").samples, 2U);
+	BOOST_CHECK_CLOSE(loaded.Get("dead").errors, 1, 0.001);
+	BOOST_CHECK_CLOSE(loaded.Get("fast").speed, 1000, 0.001);
+	BOOST_CHECK_EQUAL(loaded.Get("other").samples, 1U);
+
+	// recent stats are kept
+	const time_t updated = loaded.Get("dead").updated;
+	loaded.Decay(updated + 60);
+	BOOST_CHECK_EQUAL(loaded.Get("fast").samples, 1U);
+
+	// after some days errors fade and hosts with few samples are forgotten
+	loaded.Decay(updated + 2 * 3 * 24 * 60 * 60);
+	BOOST_CHECK_EQUAL(loaded.Get("dead").samples, 1U);
+	BOOST_CHECK_CLOSE(loaded.Get("dead").errors, 0.25, 0.1);
+	BOOST_CHECK_EQUAL(loaded.Get("fast").samples, 0U);
+	BOOST_CHECK(loaded.ExpectedTime("fast", 1000) < 0);
+
+	// concurrent writers, i.e. several processes, keep each others stats
+	CFileSystem::removeFile(path);
+	std::vector<std::thread> writers;
+	bool saved[8];
+	for (int i = 0; i < 8; i++) {
+		writers.emplace_back([&path, &saved, i]() {
+			MirrorScore writer;
+			writer.AddSample("host" + std::to_string(i), true, 100, 0.1);
+			saved[i] = writer.Save(path);
+		});
+	}
+	for (std::thread& writer : writers) {
+		writer.join();
+	}
+	MirrorScore merged;
+	BOOST_CHECK(merged.Load(path));
+	for (int i = 0; i < 8; i++) {
+		BOOST_CHECK(saved[i]);
+		BOOST_CHECK_EQUAL(merged.Get("host" + std::to_string(i)).samples, 1U);
+	}
+
+	CFileSystem::removeFile(path);
+	CFileSystem::removeFile(path + ".lock");
+}
+
+BOOST_AUTO_TEST_CASE(mirror_backoff)
+{
+	Mirror mirror("http://localhost/file");
+	Mirror::time_point now = std::chrono::steady_clock::now();
+	mirror.TransferFailed(now);
+	BOOST_CHECK(mirror.IsUsable(now)); // a single failure doesn't pause it
+
+	mirror.TransferFailed(now);
+	BOOST_CHECK(!mirror.IsUsable(now));
+	mirror.TransferFailed(now); // started before the pause, ignored
+	now += std::chrono::seconds(1);
+	BOOST_CHECK(mirror.IsUsable(now));
+
+	// a failed probe doubles the pause
+	mirror.TransferStarted(now);
+	BOOST_CHECK(!mirror.IsUsable(now)); // the next probe waits
+	mirror.TransferFailed(now);
+	BOOST_CHECK(!mirror.IsUsable(now + std::chrono::milliseconds(900)));
+	now += std::chrono::seconds(1);
+	BOOST_CHECK(mirror.IsUsable(now));
+
+	// a successful probe closes the circuit
+	mirror.TransferStarted(now);
+	mirror.TransferSucceeded();
+	BOOST_CHECK(mirror.IsUsable(now));
+	mirror.TransferFailed(now);
+	BOOST_CHECK(mirror.IsUsable(now));
+
+	// too many failed probes break it
+	for (int i = 0; i < 10; i++) {
+		mirror.TransferStarted(now);
+		mirror.TransferFailed(now);
+		now += std::chrono::seconds(60);
+	}
+	BOOST_CHECK_EQUAL(mirror.status, Mirror::STATUS_BROKEN);
+	BOOST_CHECK(!mirror.IsUsable(now));
+}
+
+BOOST_AUTO_TEST_CASE(transferlimit)
+{
+	TransferLimit limit;
+	TransferLimit::Window* host = limit.GetWindow("host");
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 2U);
+
+	// doubled while more transfers give more goodput
+	limit.SetSaturated(host);
+	TransferLimit::AddBytes(host, 1000);
+	BOOST_CHECK(limit.Update(1.0));
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 4U);
+	limit.SetSaturated(host);
+	TransferLimit::AddBytes(host, 2000);
+	BOOST_CHECK(limit.Update(1.0));
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 8U);
+
+	// the link is full, shrink and continue additive
+	limit.SetSaturated(host);
+	TransferLimit::AddBytes(host, 2000);
+	limit.Update(1.0);
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 6U);
+	limit.SetSaturated(host);
+	TransferLimit::AddBytes(host, 2200);
+	BOOST_CHECK(limit.Update(1.0));
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 7U);
+
+	// windows which didn't limit anything are kept
+	TransferLimit::AddBytes(host, 100);
+	BOOST_CHECK(!limit.Update(1.0));
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 7U);
+
+	// failed transfers halve the window
+	TransferLimit::AddResult(host, false);
+	limit.Update(1.0);
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 3U);
+	for (int i = 0; i < 5; i++) {
+		TransferLimit::AddResult(host, false);
+		limit.Update(1.0);
+	}
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 1U);
+
+	// running transfers are counted when they start / finish
+	Transfers transfers;
+	IDownload download;
+	DownloadData* data = new DownloadData();
+	data->window = host;
+	data->download = &download;
+	transfers.SetActive(data);
+	BOOST_CHECK_EQUAL(host->running, 1U);
+	BOOST_CHECK_EQUAL(transfers.GetRunning(&download), 1U);
+	transfers.SetActive(data);
+	BOOST_CHECK_EQUAL(host->running, 1U);
+	transfers.SetIdle(data);
+	BOOST_CHECK_EQUAL(host->running, 0U);
+	BOOST_CHECK_EQUAL(transfers.GetRunning(&download), 0U);
+	transfers.SetActive(data);
+	transfers.Remove(data);
+	BOOST_CHECK_EQUAL(host->running, 0U);
+
+	// the transfers of all threads are counted by the shared windows
+	Transfers other;
+	DownloadData* otherdata = new DownloadData();
+	otherdata->window = limit.GetWindow("other");
+	otherdata->download = &download;
+	transfers.SetActive(data);
+	other.SetActive(otherdata);
+	BOOST_CHECK_EQUAL(limit.GetRunning(), 2U);
+	// a thread starting a download keeps the measurement of the other one
+	TransferLimit::AddBytes(host, 1000);
+	limit.Restart();
+	limit.SetSaturated(host);
+	BOOST_CHECK(limit.Update(1.0));
+	BOOST_CHECK_EQUAL(TransferLimit::GetLimit(host), 2U);
+	transfers.Remove(data);
+	other.Remove(otherdata);
+	BOOST_CHECK_EQUAL(limit.GetRunning(), 0U);
+	delete otherdata;
+	delete data;
+}
+
+BOOST_AUTO_TEST_CASE(ratelimit)
+{
+	RateLimit limit;
+	BOOST_CHECK_EQUAL(limit.GetWait("host", nullptr, RateLimit::PRIORITY_NORMAL), 0);
+	limit.SetLimit(RateLimit::BUDGET_HOST, 1000);
+	// a full bucket holds at least one write callback
+	BOOST_CHECK_EQUAL(limit.GetWait("host", nullptr, RateLimit::PRIORITY_NORMAL), 0);
+	limit.Take("host", nullptr, 16 * 1024 + 1000);
+	const double wait = limit.GetWait("host", nullptr, RateLimit::PRIORITY_NORMAL);
+	BOOST_CHECK(wait > 0.9 && wait <= 1.0);
+	BOOST_CHECK_EQUAL(limit.GetWait("other", nullptr, RateLimit::PRIORITY_NORMAL), 0);
+
+	// high priority may overdraw by one burst
+	BOOST_CHECK_EQUAL(limit.GetWait("host", nullptr, RateLimit::PRIORITY_HIGH), 0);
+	limit.Take("host", nullptr, 16 * 1024);
+	BOOST_CHECK(limit.GetWait("host", nullptr, RateLimit::PRIORITY_HIGH) > 0);
+
+	limit.SetLimit(RateLimit::BUDGET_HOST, 0);
+	BOOST_CHECK_EQUAL(limit.GetWait("host", nullptr, RateLimit::PRIORITY_NORMAL), 0);
+}
+
+static int progressDone = 0;
+static int progressSize = 0;
+
+static void ProgressListener(int done, int size)
+{
+	progressDone = done;
+	progressSize = size;
+}
+
+BOOST_AUTO_TEST_CASE(progress)
+{
+	IDownloader::setProcessUpdateListener(ProgressListener);
+	int rapid = 0;
+	int http = 0;
+	// the listener gets the sum of the downloads of both threads
+	IDownloader::ReportProgress(&rapid, 10, 100);
+	IDownloader::ReportProgress(&http, 50, 200);
+	BOOST_CHECK_EQUAL(progressDone, 60);
+	BOOST_CHECK_EQUAL(progressSize, 300);
+	IDownloader::ReportProgress(&rapid, 100, 100);
+	BOOST_CHECK_EQUAL(progressDone, 150);
+	BOOST_CHECK_EQUAL(progressSize, 300);
+	// forgotten once all are finished
+	IDownloader::ReportProgress(&http, 200, 200);
+	BOOST_CHECK_EQUAL(progressDone, 300);
+	IDownloader::ReportProgress(&http, 0, 20);
+	BOOST_CHECK_EQUAL(progressDone, 0);
+	BOOST_CHECK_EQUAL(progressSize, 20);
+	IDownloader::ReportProgress(&http, 20, 20);
+	IDownloader::setProcessUpdateListener(nullptr);
+}
+
+static IDownload* JournalDownload(const std::string& name)
+{
+	IDownload* dl = new IDownload(name);
+	dl->size = 10;
+	dl->piecesize = 4;
+	dl->hash = new HashMD5();
+	dl->hash->Set("cecb8f0ff9046562e14628c0802676bd");
+	for (int i = 0; i < 3; i++) {
+		IDownload::piece p;
+		p.sha = new HashSHA1();
+		p.state = IDownload::STATE_NONE;
+		dl->pieces.push_back(p);
+	}
+	return dl;
+}
+
+BOOST_AUTO_TEST_CASE(journal)
+{
+	const std::string name = "journal_test.bin";
+	FILE* f = fopen(name.c_str(), "w"); // the file the journal belongs to
+	BOOST_REQUIRE(f != nullptr);
+	fclose(f);
+
+	IDownload* dl = JournalDownload(name);
+	dl->pieces[0].state = IDownload::STATE_FINISHED;
+	dl->pieces[1].pos = 2; // received by a failed transfer
+	dl->pieces[2].state = IDownload::STATE_DOWNLOADING;
+	Journal journal(dl);
+	std::map<unsigned int, int> running;
+	running[2] = 1;
+	BOOST_CHECK(journal.Save(running));
+
+	IDownload* resumed = JournalDownload(name);
+	Journal loaded(resumed);
+	BOOST_CHECK(loaded.Load());
+	BOOST_CHECK_EQUAL(resumed->pieces[0].state, IDownload::STATE_FINISHED);
+	BOOST_CHECK_EQUAL(resumed->pieces[1].state, IDownload::STATE_NONE);
+	BOOST_CHECK_EQUAL(resumed->pieces[1].pos, 2);
+	BOOST_CHECK_EQUAL(resumed->pieces[2].state, IDownload::STATE_NONE);
+	BOOST_CHECK_EQUAL(resumed->pieces[2].pos, 1);
+	delete resumed;
+
+	// written for another file
+	IDownload* other = JournalDownload(name);
+	other->size = 11;
+	Journal ignored(other);
+	BOOST_CHECK(!ignored.Load());
+	BOOST_CHECK_EQUAL(other->pieces[0].state, IDownload::STATE_NONE);
+	delete other;
+
+	journal.Remove();
+	BOOST_CHECK(!CFileSystem::fileExists(Journal::GetPath(name)));
+	delete dl;
+	CFileSystem::removeFile(name);
+}
+
+BOOST_AUTO_TEST_CASE(file_pieces)
+{
+	const std::string name = std::string("file_test") + PATH_DELIMITER + "file.bin";
+	const int pieces = 8;
+	const int piecesize = 1000;
+	CFile file;
+	BOOST_REQUIRE(file.Open(name, pieces * piecesize - 10, piecesize));
+
+	// pieces are written in chunks by different threads
+	std::vector<std::thread> threads;
+	for (int piece = 0; piece < pieces; piece++) {
+		threads.emplace_back([&file, piece]() {
+			const std::string buf(100, 'a' + piece);
+			int left = file.GetPieceSize(piece);
+			while (left > 0) {
+				const int len = std::min(left, (int)buf.size());
+				file.Write(buf.data(), len, piece);
+				left -= len;
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	char buf[piecesize];
+	for (int piece = 0; piece < pieces; piece++) {
+		const int len = file.GetPieceSize(piece);
+		BOOST_CHECK_EQUAL(file.PRead(buf, len, file.GetPieceStart(piece)), len);
+		BOOST_CHECK(std::string(buf, len) == std::string(len, 'a' + piece));
+	}
+	BOOST_CHECK_EQUAL(file.PRead(buf, 20, pieces * piecesize - 20), -1); // EOF
+
+	// a piece written again while its old data is buffered
+	const std::string old(piecesize / 2, 'x');
+	const std::string again(piecesize, 'z');
+	file.SetPiecePos(1, 0);
+	file.Write(old.data(), old.size(), 1);
+	file.SetPiecePos(1, 0);
+	file.Write(again.data(), again.size(), 1);
+	BOOST_CHECK_EQUAL(file.PRead(buf, piecesize, file.GetPieceStart(1)), piecesize);
+	BOOST_CHECK(std::string(buf, piecesize) == again);
+	file.Close();
+	BOOST_CHECK(CFileSystem::fileExists(name));
+	CFileSystem::removeFile(name);
+	CFileSystem::removeDir("file_test");
+}
+
+BOOST_AUTO_TEST_CASE(file_closeall)
+{
+	// i.e. pool files, which are written and closed together
+	std::vector<std::unique_ptr<CFile>> files;
+	std::vector<CFile*> closing;
+	for (int i = 0; i < 10; i++) {
+		const std::string name = std::string("closeall_test") + PATH_DELIMITER + std::to_string(i);
+		const std::string data(100 + i, 'a' + i);
+		files.emplace_back(new CFile());
+		BOOST_REQUIRE(files.back()->Open(name, data.size()));
+		BOOST_CHECK_EQUAL(files.back()->Write(data.data(), data.size()), (int)data.size());
+		closing.push_back(files.back().get());
+	}
+	BOOST_CHECK(CFile::CloseAll(closing));
+	for (int i = 0; i < 10; i++) {
+		const std::string name = std::string("closeall_test") + PATH_DELIMITER + std::to_string(i);
+		BOOST_CHECK(!CFileSystem::fileExists(CFile::GetTmpPath(name)));
+		FILE* f = fopen(name.c_str(), "rb");
+		BOOST_REQUIRE(f != nullptr);
+		char buf[200];
+		const size_t len = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+		BOOST_CHECK(std::string(buf, len) == std::string(100 + i, 'a' + i));
+		CFileSystem::removeFile(name);
+	}
+	CFileSystem::removeDir("closeall_test");
+}
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(file_write_error)
+{
+	CFile file;
+	BOOST_REQUIRE(file.Open("/dev/full")); // writes fail with ENOSPC
+	const std::string data(1000, 'x');
+	BOOST_CHECK_EQUAL(file.Write(data.data(), data.size()), (int)data.size()); // buffered
+	BOOST_CHECK(!file.Flush());
+	BOOST_CHECK(file.HasError());
+	BOOST_CHECK_EQUAL(file.Write(data.data(), data.size()), -1);
+	BOOST_CHECK(!file.Close());
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(ioring)
+{
+	const std::string name = "ioring_test.bin";
+	FILE* f = fopen(name.c_str(), "w+");
+	BOOST_REQUIRE(f != nullptr);
+	const int fd = fileno(f);
+
+	IoRing ring(4); // more ops than entries are run in several batches
+	std::string data[6];
+	std::vector<IoRing::Op> ops(6);
+	for (int i = 0; i < 6; i++) {
+		data[i] = std::string(100, 'a' + i);
+		ops[i].code = IoRing::OP_WRITE;
+		ops[i].fd = fd;
+		ops[i].buf = &data[i][0];
+		ops[i].len = data[i].size();
+		ops[i].offset = i * 100;
+	}
+	BOOST_CHECK(ring.Run(ops));
+
+	std::string read(600, ' ');
+	ops.resize(1);
+	ops[0].code = IoRing::OP_READ;
+	ops[0].buf = &read[0];
+	ops[0].len = read.size();
+	ops[0].offset = 0;
+	BOOST_CHECK(ring.Run(ops));
+	BOOST_CHECK(read.substr(500) == data[5]);
+	ops[0].offset = 100; // EOF
+	BOOST_CHECK(!ring.Run(ops));
+	BOOST_CHECK_EQUAL(ops[0].result, 500);
+	fclose(f);
+	CFileSystem::removeFile(name);
+}
+
+// writes content gzipped to its pool file in pool
+static std::string WritePoolFile(const std::string& pool, const std::string& content)
+{
+	HashMD5 hash;
+	hash.Init();
+	hash.Update(content.data(), content.size());
+	hash.Final();
+	const std::string md5 = hash.toString();
+	const std::string dir = pool + PATH_DELIMITER + md5.substr(0, 2);
+	CFileSystem::createSubdirs(dir);
+	const std::string path = dir + PATH_DELIMITER + md5.substr(2) + ".gz";
+	gzFile gz = gzopen(path.c_str(), "wb");
+	gzwrite(gz, content.data(), content.size());
+	gzclose(gz);
+	return path;
+}
+
+BOOST_AUTO_TEST_CASE(validatepool)
+{
+	const std::string pool = "pool_test";
+	const std::string paths[] = {WritePoolFile(pool, "valid"),
+				     WritePoolFile(pool, std::string(1024 * 1024, 'x'))}; // too large for a batch
+	const std::string broken = WritePoolFile(pool, "broken");
+	FILE* f = fopen(broken.c_str(), "r+");
+	BOOST_REQUIRE(f != nullptr);
+	fseek(f, 12, SEEK_SET);
+	fputc('!', f);
+	fclose(f);
+
+	std::vector<std::string> more; // several batches for the workers
+	for (int i = 0; i < 300; i++) {
+		more.push_back(WritePoolFile(pool, "file " + std::to_string(i)));
+	}
+
+	BOOST_CHECK_EQUAL(CFileSystem::GetInstance()->validatePool(pool, true), 302);
+	BOOST_CHECK(!CFileSystem::fileExists(broken));
+	BOOST_CHECK_EQUAL(CFileSystem::GetInstance()->validatePool(pool, true), 302); // unchanged
+	BOOST_CHECK_EQUAL(CFileSystem::GetInstance()->validatePool(pool, true, true), 302);
+#ifndef _WIN32
+	// with few file descriptors the files are opened in smaller chunks
+	struct rlimit limit;
+	BOOST_REQUIRE(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+	struct rlimit low = limit;
+	low.rlim_cur = 40;
+	BOOST_REQUIRE(setrlimit(RLIMIT_NOFILE, &low) == 0);
+	const int valid = CFileSystem::GetInstance()->validatePool(pool, true, true);
+	setrlimit(RLIMIT_NOFILE, &limit);
+	BOOST_CHECK_EQUAL(valid, 302);
+#endif
+	for (const std::string& path : more) {
+		CFileSystem::removeFile(path);
+	}
+	for (const std::string& path : more) {
+		CFileSystem::removeDir(CFileSystem::DirName(path));
+	}
+	for (const std::string& path : paths) {
+		CFileSystem::removeFile(path);
+		CFileSystem::removeDir(CFileSystem::DirName(path));
+	}
+	CFileSystem::removeDir(CFileSystem::DirName(broken));
+	CFileSystem::removeDir(pool);
+}
+
+BOOST_AUTO_TEST_CASE(hashgzipmd5)
+{
+	std::string content;
+	for (int i = 0; i < 100000; i++) {
+		content += std::to_string(i);
+	}
+	HashMD5 expected;
+	expected.Init();
+	expected.Update(content.data(), content.size());
+	expected.Final();
+
+	uLongf len = compressBound(content.size()) + 32;
+	std::string gz(len, 0);
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	BOOST_REQUIRE(deflateInit2(&zs, 9, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	zs.next_in = (unsigned char*)&content[0];
+	zs.avail_in = content.size();
+	zs.next_out = (unsigned char*)&gz[0];
+	zs.avail_out = len;
+	BOOST_REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+	gz.resize(zs.total_out);
+	deflateEnd(&zs);
+
+	// fed in small chunks, as received by curl
+	HashGzipMD5 hash;
+	hash.Init();
+	for (size_t pos = 0; pos < gz.size(); pos += 1000) {
+		hash.Update(gz.data() + pos, std::min((size_t)1000, gz.size() - pos));
+	}
+	hash.Final();
+	BOOST_CHECK(hash.compare(expected.Data(), expected.getSize()));
+
+	// truncated
+	hash.Init();
+	hash.Update(gz.data(), gz.size() - 10);
+	hash.Final();
+	BOOST_CHECK(!hash.compare(expected.Data(), expected.getSize()));
+
+	// damaged
+	gz[gz.size() / 2] ^= 0x55;
+	hash.Init();
+	hash.Update(gz.data(), gz.size());
+	hash.Final();
+	BOOST_CHECK(!hash.compare(expected.Data(), expected.getSize()));
+}
+
+BOOST_AUTO_TEST_CASE(poolindex)
+{
+	const std::string pool = "poolindex_test";
+	const std::string path = "poolindex_test.txt";
+	CFileSystem::removeFile(path);
+	const std::string file = WritePoolFile(pool, "present");
+	const std::string md5 = file.substr(pool.size() + 1, 2) + file.substr(pool.size() + 4, 30);
+	const std::string other = "00112233445566778899aabbccddeeff";
+
+	PoolIndex index(pool, path);
+	BOOST_CHECK(index.Contains(md5)); // scanned
+	BOOST_CHECK(!index.Contains(other));
+	BOOST_CHECK(CFileSystem::directoryExists(pool + PATH_DELIMITER + "ff"));
+	index.Add(other);
+	BOOST_CHECK(index.Contains(other));
+
+	std::list<FileData> files(2);
+	for (int i = 0; i < 16; i++) {
+		files.front().md5[i] = strtol(md5.substr(i * 2, 2).c_str(), nullptr, 16);
+		files.back().md5[i] = i;
+	}
+	BOOST_CHECK_EQUAL(index.MarkMissing(files), 1);
+	BOOST_CHECK(!files.front().download);
+	BOOST_CHECK(files.back().download);
+	BOOST_CHECK(index.Save());
+
+	PoolIndex loaded(pool, path); // i.e. the next run
+	BOOST_CHECK(loaded.Contains(md5));
+	loaded.Remove(md5);
+	BOOST_CHECK(!loaded.Contains(md5));
+	loaded.Rescan(); // finds the file again
+	BOOST_CHECK(loaded.Contains(md5));
+	BOOST_CHECK(!loaded.Contains(other));
+
+	CFileSystem::removeFile(file);
+	CFileSystem::removeFile(path);
+	for (int i = 0; i < 256; i++) {
+		char dir[3];
+		snprintf(dir, sizeof(dir), "%02x", i);
+		CFileSystem::removeDir(pool + PATH_DELIMITER + dir);
+	}
+	CFileSystem::removeDir(pool);
+}
+
+#ifndef _WIN32
+// @return mtime saved for the directory with index 0
+static long long SavedMtime(const std::string& path)
+{
+	FILE* f = fopen(path.c_str(), "r");
+	BOOST_REQUIRE(f != nullptr);
+	char line[256];
+	long long mtime = -1;
+	while ((mtime < 0) && (fgets(line, sizeof(line), f) != nullptr)) {
+		int i;
+		long long t;
+		unsigned int count;
+		if ((sscanf(line, "%d %lld %u", &i, &t, &count) == 3) && (i == 0)) {
+			mtime = t;
+		}
+	}
+	fclose(f);
+	return mtime;
+}
+
+BOOST_AUTO_TEST_CASE(poolindex_mtime)
+{
+	const std::string pool = "poolindex_mtime_test";
+	const std::string path = "poolindex_mtime_test.txt";
+	const std::string dir = pool + PATH_DELIMITER + "00";
+	const std::string md5 = "00112233445566778899aabbccddeeff";
+	const time_t now = time(nullptr);
+	CFileSystem::removeFile(path);
+	BOOST_REQUIRE(CFileSystem::createSubdirs(dir + PATH_DELIMITER));
+	struct utimbuf times;
+	times.actime = times.modtime = now - 100;
+	BOOST_REQUIRE(utime(dir.c_str(), &times) == 0);
+
+	PoolIndex index(pool, path);
+	BOOST_CHECK(!index.Contains(md5)); // scanned
+	index.Prepare(md5);
+	times.modtime = now - 50; // our write
+	utime(dir.c_str(), &times);
+	index.Add(md5);
+	BOOST_CHECK(index.Save());
+	BOOST_CHECK_EQUAL(SavedMtime(path), now - 50);
+
+	// several files are prepared before they're added
+	const std::string second = "00ffeeddccbbaa998877665544332211";
+	index.Prepare(second);
+	times.modtime = now - 45;
+	utime(dir.c_str(), &times);
+	index.Prepare(md5);
+	times.modtime = now - 44;
+	utime(dir.c_str(), &times);
+	index.Add(second);
+	index.Remove(md5);
+	BOOST_CHECK(index.Save());
+	BOOST_CHECK_EQUAL(SavedMtime(path), now - 44);
+
+	times.modtime = now - 40; // changed by someone else
+	utime(dir.c_str(), &times);
+	index.Prepare(md5);
+	times.modtime = now - 30;
+	utime(dir.c_str(), &times);
+	index.Remove(md5);
+	BOOST_CHECK(index.Save());
+	BOOST_CHECK_EQUAL(SavedMtime(path), 0);
+
+	// a file removed by another process is noticed by MarkMissing
+	const std::string file = dir + PATH_DELIMITER + md5.substr(2) + ".gz";
+	FILE* f = fopen(file.c_str(), "wb");
+	BOOST_REQUIRE(f != nullptr);
+	fclose(f);
+	times.modtime = now - 20;
+	utime(dir.c_str(), &times);
+	PoolIndex running(pool, path + ".running");
+	BOOST_CHECK(running.Contains(md5));
+	CFileSystem::removeFile(file);
+	std::list<FileData> files(1);
+	for (int i = 0; i < 16; i++) {
+		files.front().md5[i] = strtol(md5.substr(i * 2, 2).c_str(), nullptr, 16);
+	}
+	BOOST_CHECK_EQUAL(running.MarkMissing(files), 1);
+	BOOST_CHECK(files.front().download);
+
+	CFileSystem::removeFile(path);
+	for (int i = 0; i < 256; i++) {
+		char sub[3];
+		snprintf(sub, sizeof(sub), "%02x", i);
+		CFileSystem::removeDir(pool + PATH_DELIMITER + sub);
+	}
+	CFileSystem::removeDir(pool);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(validationledger)
+{
+	const std::string path = "validationledger_test.txt";
+	const std::string file = "validationledger_test.bin";
+	const std::string md5 = "00112233445566778899aabbccddeeff";
+	CFileSystem::removeFile(path);
+	FILE* f = fopen(file.c_str(), "wb");
+	BOOST_REQUIRE(f != nullptr);
+	fputs("content", f);
+	fclose(f);
+
+	ValidationLedger::Stat stat;
+	BOOST_REQUIRE(ValidationLedger::GetStat(file, stat));
+	BOOST_CHECK_EQUAL(stat.size, 7);
+	ValidationLedger ledger(path);
+	BOOST_CHECK(!ledger.IsValidated(md5, stat));
+	ledger.Add(md5, stat);
+	BOOST_CHECK(ledger.IsValidated(md5, stat));
+	BOOST_CHECK(ledger.Save());
+
+	ValidationLedger loaded(path); // i.e. the next run
+	BOOST_CHECK(loaded.IsValidated(md5, stat));
+	f = fopen(file.c_str(), "ab");
+	BOOST_REQUIRE(f != nullptr);
+	fputs(" changed", f);
+	fclose(f);
+	ValidationLedger::Stat changed;
+	BOOST_REQUIRE(ValidationLedger::GetStat(file, changed));
+	BOOST_CHECK(!loaded.IsValidated(md5, changed));
+	loaded.Remove(md5);
+	BOOST_CHECK(!loaded.IsValidated(md5, stat));
+
+	CFileSystem::removeFile(file);
+	CFileSystem::removeFile(path);
+}
+
+BOOST_AUTO_TEST_CASE(quickcheck)
+{
+	std::list<FileData> files(2);
+	std::vector<std::string> paths;
+	for (FileData& fd : files) {
+		const std::string content = "quick check " + std::to_string(paths.size());
+		HashMD5 hash;
+		hash.Init();
+		hash.Update(content.data(), content.size());
+		hash.Final();
+		memcpy(fd.md5, hash.Data(), sizeof(fd.md5));
+		const unsigned int crc = crc32(0, (const Bytef*)content.data(), content.size());
+		for (int i = 0; i < 4; i++) { // little endian, as written by the rapid tools
+			fd.crc32[i] = (crc >> (i * 8)) & 0xff;
+		}
+		fd.size = content.size();
+		paths.push_back(CFileSystem::GetInstance()->getPoolFilename(hash.toString()));
+		CFileSystem::createSubdirs(CFileSystem::DirName(paths.back()));
+		gzFile gz = gzopen(paths.back().c_str(), "wb");
+		BOOST_REQUIRE(gz != nullptr);
+		gzwrite(gz, content.data(), content.size());
+		gzclose(gz);
+	}
+	BOOST_CHECK(CFileSystem::GetInstance()->quickCheckFiles(files));
+
+	// damaged ISIZE is noticed and the file removed
+	FILE* f = fopen(paths.back().c_str(), "r+b");
+	BOOST_REQUIRE(f != nullptr);
+	fseek(f, -1, SEEK_END);
+	fputc(0x7f, f);
+	fclose(f);
+	BOOST_CHECK(!CFileSystem::GetInstance()->quickCheckFiles(files));
+	BOOST_CHECK(!CFileSystem::fileExists(paths.back()));
+	// missing file
+	BOOST_CHECK(!CFileSystem::GetInstance()->quickCheckFiles(files));
+
+	CFileSystem::removeFile(paths.front());
+}